@@ -49,7 +49,9 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
     //cprintf("[bc_pgfault]fault va:%x\n", addr); 
-    if ((r = sys_page_alloc(thisenv->env_id, (void*)ROUNDDOWN(addr, BLKSIZE), PTE_SYSCALL)) < 0)
+    // The disk read below fills the whole page, so don't clear it first.
+    if ((r = sys_page_alloc_flags(thisenv->env_id, (void*)ROUNDDOWN(addr, BLKSIZE),
+                                  PTE_SYSCALL, SYS_PAGE_NOZERO)) < 0)
 		panic("[bc_pgfault]sys_page_alloc: %e", r);
     ide_read(blockno * BLKSECTS, ROUNDDOWN(addr, BLKSIZE), BLKSECTS);
 
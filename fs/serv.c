@@ -314,24 +314,63 @@ fshandler handlers[] = {
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Requests small enough to arrive in an IPC message (ipc_call_msg)
+// instead of a page.  They are answered with a message, too.
+static const bool msg_handlers[] = {
+	[FSREQ_STAT] =		1,
+	[FSREQ_FLUSH] =		1,
+	[FSREQ_SET_SIZE] =	1,
+	[FSREQ_SYNC] =		1
+};
+#define NMSGHANDLERS (sizeof(msg_handlers)/sizeof(msg_handlers[0]))
+
+// Message requests are copied here, since env_ipc_msg is read-only and
+// the handlers write their replies over their requests.
+static union Fsipc fsmsg;
+
 void
 serve(void)
 {
 	uint32_t req, whom;
 	int perm, r;
 	void *pg;
+	union Fsipc *args;
+	size_t replylen;
+
+	static_assert(sizeof(struct Fsret_stat) <= IPC_MSG_MAX);
 
+	whom = 0;
+	r = 0;
+	pg = NULL;
+	perm = 0;
+	args = fsreq;
+	replylen = 0;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Reply to the previous request, if any, and wait for the
+		// next one in a single system call.  A request that came in
+		// a message is answered with one.
+		if (args == &fsmsg)
+			req = ipc_reply_recv_msg(whom, r, &fsmsg, replylen,
+						 (int32_t *) &whom, fsreq, &perm);
+		else
+			req = ipc_reply_recv(whom, r, pg, perm,
+					     (int32_t *) &whom, fsreq, &perm);
 		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
-
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+			cprintf("fs req %d from %08x [page %08x]\n",
+				req, whom, uvpt[PGNUM(fsreq)]);
+
+		if (perm & PTE_P) {
+			args = fsreq;
+		} else if (req < NMSGHANDLERS && msg_handlers[req]) {
+			memset(&fsmsg, 0, IPC_MSG_MAX);
+			memmove(&fsmsg, (const void *) thisenv->env_ipc_msg,
+				thisenv->env_ipc_msglen);
+			args = &fsmsg;
+		} else {
+			// All other requests must contain an argument page
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
@@ -341,20 +380,25 @@ serve(void)
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
             //cprintf("[fs serve]req is others\n");
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, args);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
         //cprintf("[serve]id:%x, r:%d, pg:%x, perm:%x\n", whom, r, pg, perm);
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (args == &fsmsg)
+			replylen = (req == FSREQ_STAT && r == 0) ?
+				sizeof(struct Fsret_stat) : 0;
+		else
+			sys_page_unmap(0, fsreq);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	int n, r;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -363,6 +407,13 @@ umain(int argc, char **argv)
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
+	// Keep the file server on a core of its own, the last one, away
+	// from the boot CPU when there is more than one.  If pinning
+	// fails, run wherever the scheduler puts us.
+	if ((n = sys_ncpu()) > 1
+	    && (r = sys_env_set_affinity(0, 1 << (n - 1))) < 0)
+		cprintf("FS: cannot set CPU affinity: %e\n", r);
+
 	serve_init();
 	fs_init();
 	serve();
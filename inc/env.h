@@ -9,6 +9,8 @@
 
 typedef int32_t envid_t;
 
+struct CpuInfo;
+
 // An environment ID 'envid_t' has three parts:
 //
 // +1+---------------21-----------------+--------10--------+
@@ -45,6 +47,29 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Largest message that IPC copies through the kernel instead of mapping
+// a page (see sys_ipc_call_msg).
+#define IPC_MSG_MAX	192
+
+// A FIFO of environments blocked in sys_ipc_send, linked through their
+// env_ipc_send_next/env_ipc_send_prev fields.
+struct EnvQueue {
+	struct Env *eq_head;
+	struct Env *eq_tail;
+};
+
+// Scheduling parameters (sys_env_set_priority).  Real-time priorities
+// 1..ENV_PRIO_RT_MAX always run before ENV_PRIO_NORMAL environments,
+// which share the CPU in proportion to their weights.
+#define ENV_PRIO_NORMAL		0
+#define ENV_PRIO_SERVER		4	// File and network servers
+#define ENV_PRIO_RT_MAX		8
+#define ENV_WEIGHT_DEFAULT	16
+#define ENV_WEIGHT_MAX		1024
+
+// CPU affinity mask allowing every CPU (sys_env_set_affinity).
+#define ENV_AFFINITY_ALL	0xFFFFFFFF
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -55,18 +80,55 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct CpuInfo *env_rq;		// Run queue holding this env, or NULL
+	struct Env *env_rq_next;	// Next env on the run queue
+	struct Env *env_rq_prev;	// Previous env on the run queue
+	int env_prio;			// Real-time priority, or ENV_PRIO_NORMAL
+	uint32_t env_weight;		// Share of the CPU in the normal class
+	uint64_t env_pass;		// Stride-scheduling virtual time
+	uint64_t env_runtime;		// TSC cycles spent running
+	uint64_t env_run_start;		// TSC when last charged for running
+	uint32_t env_affinity;		// Bit i set if it may run on cpus[i]
+
+	// Timed sleep (kern/timer.c)
+	uint32_t env_timer_deadline;	// time_msec() at which to wake
+	int env_timer_idx;		// Index in the timer heap, or -1
+	bool env_timer_armed;		// Waiting for env_timer_deadline
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	uint32_t env_lock_idx;		// Lock shared by envs on env_pgdir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_uxstacktop;	// Top of the user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
+	envid_t env_ipc_recv_from;	// Only from this env (a reply), or 0
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_handoff;	// Receiver woken by our last send
+
+	// Blocking send (sys_ipc_send)
+	struct EnvQueue env_ipc_senders;	// Senders blocked on us
+	struct EnvQueue *env_ipc_sendq;	// Queue we are blocked on, or NULL
+	struct Env *env_ipc_send_next;	// Next sender on that queue
+	struct Env *env_ipc_send_prev;	// Previous sender on that queue
+	envid_t env_ipc_send_to;	// Receiver we are blocked on, or 0
+	uint32_t env_ipc_send_value;	// Value we are trying to send
+	void *env_ipc_send_srcva;	// Page we are trying to send
+	unsigned env_ipc_send_perm;	// Perm of that page
+	bool env_ipc_send_call;		// Then wait for a reply (sys_ipc_call)
+	const void *env_ipc_send_msg;	// Message we are trying to send
+	size_t env_ipc_send_msglen;	// Its length in bytes
+
+	// Small IPC message received, copied by the kernel
+	size_t env_ipc_msglen;		// Length in bytes, 0 if none
+	uint8_t env_ipc_msg[IPC_MSG_MAX];
 };
 
 #endif // !JOS_INC_ENV_H
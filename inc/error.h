@@ -28,6 +28,7 @@ enum {
 
     E_TX_BUF_FULL,   // Pci tx ring buffer full
     E_RX_BUF_EMPTY,  // Pci rx ring buffer empty
+    E_TIMEOUT,       // Deadline passed before the operation completed
 
 	MAXERROR
 };
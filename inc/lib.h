@@ -22,6 +22,8 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/time.h>
+#include <inc/x86.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,10 +32,33 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+extern const volatile struct Env *thread_envs[];
 extern const volatile struct Env envs[NENV];
+extern const volatile struct TimeInfo timeinfo;
 extern const volatile struct PageInfo pages[];
 
+// Threads made by sfork() share the address space, so each needs its
+// own stack and its own idea of thisenv.  Thread k > 0 lives in the
+// THREAD_SLOT bytes ending at USTACKTOP - k * THREAD_SLOT: from the
+// top down, its stack page, a guard page, its exception stack and
+// another guard page.  Slot 0 is the initial stack.
+#define THREAD_SLOT	(4 * PGSIZE)
+#define THREAD_MAX	256
+
+static __inline const volatile struct Env **
+thisenv_ref(void)
+{
+	uint32_t esp = read_esp();
+	uint32_t slot = 0;
+
+	if (esp < USTACKTOP - THREAD_SLOT)
+		slot = (USTACKTOP - esp) / THREAD_SLOT;
+	if (slot >= THREAD_MAX)
+		slot = 0;
+	return &thread_envs[slot];
+}
+#define thisenv		(*thisenv_ref())
+
 // exit.c
 void	exit(void);
 
@@ -50,16 +75,39 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
+static envid_t sys_sfork(void *stack, uintptr_t xstacktop);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
+int	sys_env_set_priority(envid_t env, int prio, uint32_t weight);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
+int	sys_ncpu(void);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_flags(envid_t env, void *pg, int perm, int flags);
+int	sys_page_alloc_contig(envid_t env, void *va, int perm, unsigned order,
+			      physaddr_t *pa_store);
+int	sys_vm_reserve(envid_t env, void *va, size_t len, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_until(void *rcv_pg, uint32_t deadline);
+int	sys_sleep_until(uint32_t deadline);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_call_msg(envid_t to_env, uint32_t value, const void *msg,
+			 size_t len, void *rcv_pg);
+int	sys_ipc_reply_recv_msg(envid_t to_env, uint32_t value, const void *msg,
+			       size_t len, void *rcv_pg);
 unsigned int sys_time_msec(void);
+uint64_t sys_time_usec(void);
+uint64_t sys_time_nsec(void);
+int	sys_batch(struct SyscallDesc *descs, size_t n);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -74,15 +122,60 @@ sys_exofork(void)
 	return ret;
 }
 
+// Likewise: the child resumes with only %esp and %ebp moved onto its
+// new stack.
+static __inline envid_t __attribute__((always_inline))
+sys_sfork(void *stack, uintptr_t xstacktop)
+{
+	envid_t ret;
+	__asm __volatile("int %3"
+		: "=a" (ret)
+		: "a" (SYS_sfork),
+		  "d" (stack),
+		  "i" (T_SYSCALL),
+		  "c" (xstacktop)
+		: "cc", "memory");
+	return ret;
+}
+
+// time.c
+unsigned int	time_msec(void);
+uint64_t	time_usec(void);
+uint64_t	time_nsec(void);
+
+// batch.c
+// A batch of system calls being collected for sys_batch.  Keep these
+// on the stack: if an earlier entry makes the page holding the array
+// copy-on-write, writing the results back costs a page copy, and ufork
+// never does that to the page the stack pointer is on.
+struct SysBatch {
+	struct SyscallDesc sb_descs[SYSBATCH_MAX];
+	size_t sb_n;
+};
+void	batch_init(struct SysBatch *b);
+int	batch_add(struct SysBatch *b, uint32_t num, uint32_t a1, uint32_t a2,
+		  uint32_t a3, uint32_t a4, uint32_t a5);
+int	batch_flush(struct SysBatch *b);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_call_msg(envid_t to_env, uint32_t value, const void *msg,
+		     size_t len, void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv_msg(envid_t to_env, uint32_t value, const void *msg,
+			   size_t len, envid_t *from_env_store, void *rcv_pg,
+			   int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void);
+extern volatile int thread_count;
 
 // fd.c
 int	close(int fd);
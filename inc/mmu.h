@@ -65,10 +65,25 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware, so user
+// processes are allowed to set them arbitrarily.  The kernel only gives
+// meaning to the two below.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_SHARE marks a page that fork and spawn share with the child
+// instead of copying it.
+#define PTE_SHARE	0x400
+
+// PTE_COW marks a read-only copy-on-write mapping: on a write fault the
+// kernel gives the environment its own writable copy of the page (see
+// page_cow_break in kern/pmap.c).
+#define PTE_COW		0x800
+
+// PTE_ZERO, in an entry without PTE_P, reserves the page as demand-zero:
+// the first access maps a fresh zero-filled page with the entry's other
+// permission bits (see sys_vm_reserve).
+#define PTE_ZERO	0x080
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
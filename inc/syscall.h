@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
     SYS_cputs = 0,
@@ -20,7 +22,37 @@ enum {
     SYS_time_msec,
     SYS_transmit_pkt,
     SYS_receive_pkt,
+    SYS_ipc_send,
+    SYS_ipc_call,
+    SYS_ipc_reply_recv,
+    SYS_ipc_call_msg,
+    SYS_ipc_reply_recv_msg,
+    SYS_batch,
+    SYS_time_usec,
+    SYS_time_nsec,
+    SYS_sleep_until,
+    SYS_env_set_priority,
+    SYS_env_set_affinity,
+    SYS_page_alloc_contig,
+    SYS_fork,
+    SYS_sfork,
+    SYS_vm_reserve,
+    SYS_ncpu,
     NSYSCALLS
 };
 
+// Flags for sys_page_alloc_flags().
+#define SYS_PAGE_NOZERO	0x1	// Caller overwrites the whole page
+
+// One entry of a sys_batch() array: a system call number, its
+// arguments, and the slot where the kernel stores its result.
+struct SyscallDesc {
+	uint32_t sd_num;
+	uint32_t sd_args[5];
+	int32_t sd_ret;
+};
+
+// Most entries one sys_batch() call may carry
+#define SYSBATCH_MAX	32
+
 #endif /* !JOS_INC_SYSCALL_H */
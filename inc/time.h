@@ -0,0 +1,69 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+// Whether time_msec() value 'a' comes before 'b', allowing for the
+// 32-bit millisecond counter wrapping around.
+static inline bool
+msec_before(uint32_t a, uint32_t b)
+{
+	return (int32_t) (a - b) < 0;
+}
+
+// The kernel's clock, mapped read-only into every environment at UTIME
+// so that reading the time does not need a system call.  The kernel
+// makes ti_seq odd while it updates the other fields and even again
+// afterwards; readers retry if they saw an odd or changing ti_seq.
+struct TimeInfo {
+	volatile uint32_t ti_seq;
+	uint32_t ti_tsc_mult;		// ns per TSC cycle, scaled by 2^ti_tsc_shift,
+	uint32_t ti_tsc_shift;		//   or 0 if the TSC is not calibrated
+	uint32_t ti_pad;
+	uint64_t ti_tsc;		// TSC when ti_nsec was taken
+	uint64_t ti_nsec;		// ns since boot at ti_tsc
+};
+
+// Convert 'cycles' TSC cycles to ns.  Splitting 'cycles' in two keeps
+// the 64-bit products from overflowing however long the interval.
+static inline uint64_t
+tsc_to_nsec(uint64_t cycles, uint32_t mult, uint32_t shift)
+{
+	uint64_t hi = (cycles >> 32) * mult;
+	uint64_t lo = (uint64_t) (uint32_t) cycles * mult;
+
+	return (hi << (32 - shift)) + (lo >> shift);
+}
+
+// Return the time in ns since boot according to 'ti'.
+static inline uint64_t
+timeinfo_nsec(const volatile struct TimeInfo *ti)
+{
+	uint32_t seq, mult, shift;
+	uint64_t tsc, nsec;
+	int64_t delta;
+
+	do {
+		seq = ti->ti_seq;
+		asm volatile("" ::: "memory");
+		mult = ti->ti_tsc_mult;
+		shift = ti->ti_tsc_shift;
+		tsc = ti->ti_tsc;
+		nsec = ti->ti_nsec;
+		asm volatile("" ::: "memory");
+	} while ((seq & 1) || seq != ti->ti_seq);
+
+	// Another CPU's TSC may be slightly behind the one that last
+	// updated the page; never report a time before ti_nsec.
+	delta = (int64_t) (read_tsc() - tsc);
+	if (mult == 0 || delta <= 0)
+		return nsec;
+	return nsec + tsc_to_nsec(delta, mult, shift);
+}
+
+#endif /* !JOS_INC_TIME_H */
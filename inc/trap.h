@@ -38,6 +38,8 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20	// reschedule IPI between CPUs
+#define IRQ_TLB         21	// TLB shootdown IPI between CPUs
 
 #ifndef __ASSEMBLER__
 
@@ -3,6 +3,14 @@
 
 #include <inc/types.h>
 
+// Model-specific registers used by sysenter/sysexit
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+// CPUID.1:EDX feature bits
+#define CPUID_FEAT_SEP		(1 << 11)	// sysenter/sysexit
+
 static __inline void breakpoint(void) __attribute__((always_inline));
 static __inline uint8_t inb(int port) __attribute__((always_inline));
 static __inline void insb(int port, void *addr, int cnt) __attribute__((always_inline));
@@ -34,6 +42,8 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -280,6 +290,20 @@ read_tsc(void)
 	return tsc;
 }
 
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -293,4 +317,51 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'delta' to *addr and return the old value.
+static inline uint32_t
+atomic_add(volatile uint32_t *addr, int32_t delta)
+{
+	uint32_t result;
+
+	asm volatile("lock; xaddl %0, %1" :
+			"=r" (result), "+m" (*addr) :
+			"0" (delta) :
+			"cc");
+	return result;
+}
+
+// Atomically add 'delta' to the 16-bit *addr and return the old value.
+static inline uint16_t
+atomic_add16(volatile uint16_t *addr, int16_t delta)
+{
+	uint16_t result;
+
+	asm volatile("lock; xaddw %0, %1" :
+			"=r" (result), "+m" (*addr) :
+			"0" (delta) :
+			"cc");
+	return result;
+}
+
+// Order all earlier loads and stores before all later ones.
+static inline void
+mfence(void)
+{
+	asm volatile("mfence" ::: "memory");
+}
+
+// Atomically set the bits 'mask' in *addr.
+static inline void
+atomic_or(volatile uint32_t *addr, uint32_t mask)
+{
+	asm volatile("lock; orl %1, %0" : "+m" (*addr) : "r" (mask) : "cc");
+}
+
+// Atomically clear the bits 'mask' in *addr.
+static inline void
+atomic_andnot(volatile uint32_t *addr, uint32_t mask)
+{
+	asm volatile("lock; andl %1, %0" : "+m" (*addr) : "r" (~mask) : "cc");
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -8,10 +8,19 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Serializes the console input buffer and whole cprintf()s, so that
+// output from different CPUs is not interleaved mid-line.
+static struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "cons_lock"
+#endif
+};
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 //bocui comment
 //0x84 is used to access "extra page register". 
@@ -410,6 +419,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&cons_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -417,6 +427,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -432,13 +443,28 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
+}
+
+// Take and release the console lock around a multi-character write.
+void
+cons_lock_acquire(void)
+{
+	spin_lock(&cons_lock);
+}
+
+void
+cons_lock_release(void)
+{
+	spin_unlock(&cons_lock);
 }
 
 // output a character to the console
@@ -19,6 +19,8 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_lock_acquire(void);
+void cons_lock_release(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
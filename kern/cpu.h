@@ -6,6 +6,7 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -17,13 +18,45 @@ enum {
 	CPU_HALTED,
 };
 
+// Size of a cache line.  Per-CPU data is aligned to it so that CPUs do
+// not false-share lines they each write all the time.
+#define CPU_CACHE_LINE	64
+
+// TLB entries of one address space for other CPUs to flush, and the
+// pages to free once they have (see tlb_invalidate in kern/pmap.c).
+#define TLB_BATCH_MAX	16
+struct TlbBatch {
+	pde_t *tb_pgdir;                // Address space of the entries
+	uint32_t tb_cpus;               // CPUs that may cache them
+	volatile uint32_t tb_pending;   // CPUs that have yet to flush them
+	int tb_nva;                     // Entries in tb_va, or -1 for all
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	int tb_nfree;                   // Pages waiting for the flush
+	struct PageInfo *tb_free[TLB_BATCH_MAX];
+	int tb_depth;                   // Nesting of tlb_batch_begin()
+};
+
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // This struct, for thiscpu
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
-};
+
+	// Per-CPU run queue of ENV_RUNNABLE environments (see kern/sched.c)
+	struct spinlock cpu_rq_lock;    // Protects the three fields below
+	struct Env *cpu_rq_head;        // Next environment to run
+	struct Env *cpu_rq_tail;        // Most recently queued environment
+	volatile uint32_t cpu_rq_len;   // Number of queued environments
+	uint64_t cpu_vtime;             // Pass of the last normal env taken
+	volatile bool cpu_resched;      // Reschedule before returning to user
+	volatile bool cpu_timer_stale;  // LAPIC timer needs sched_timer_arm
+
+	// TLB shootdown
+	volatile uint32_t cpu_tlb_from; // Bit i: flush what cpus[i] asks for
+	struct TlbBatch cpu_tlb;        // What this CPU asks the others
+} __attribute__((aligned(CPU_CACHE_LINE)));
 
 // Initialized in mpconfig.c
 extern struct CpuInfo cpus[NCPU];
@@ -34,13 +67,36 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// The running CPU's struct CpuInfo.  Each CPU's %gs selects a segment
+// based at its own cpus[] entry (see env_init_percpu), so this is one
+// load rather than a read of the LAPIC ID.  The kernel never moves to
+// another CPU in the middle of a function, so the result may be reused.
+static inline struct CpuInfo *
+thiscpu_get(void)
+{
+	struct CpuInfo *c;
+
+	asm("movl %%gs:%c1, %0"
+	    : "=r" (c) : "i" (offsetof(struct CpuInfo, cpu_self)));
+	return c;
+}
+#define thiscpu (thiscpu_get())
+
+static inline int
+cpunum(void)
+{
+	return thiscpu->cpu_id;
+}
 
 void mp_init(void);
 void lapic_init(void);
+int lapic_id(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+uint32_t lapic_timer_count(void);
+void lapic_timer_oneshot(uint32_t usec);
+void lapic_timer_stop(void);
 
 #endif
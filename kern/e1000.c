@@ -1,5 +1,6 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 #include <inc/error.h>
 
 // LAB 6: Your driver code here
@@ -11,6 +12,11 @@
 #define RX_DESC_LEN  (RX_DESC_SIZE/8) << 7 
 #define RX_PTR_MSK (0xff >> 1)
 #define MAX_PKT_SZ 1518
+#define PKT_BUF_SZ 2048
+
+// Page orders of the contiguous runs holding all the packet buffers
+#define TX_BUF_ORDER 2    // 4 pages for TX_DESC_SIZE buffers
+#define RX_BUF_ORDER 6    // 64 pages for RX_DESC_SIZE buffers
 
 volatile uint32_t *pci_e1000;
 
@@ -18,6 +24,19 @@ volatile uint32_t *pci_e1000;
 struct tx_desc tx_desc_list[TX_DESC_SIZE];
 struct rx_desc rx_desc_list[RX_DESC_SIZE];
 
+// The tail registers and descriptor rings are shared by every CPU that
+// makes a transmit or receive system call.
+static struct spinlock tx_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "tx_lock"
+#endif
+};
+static struct spinlock rx_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "rx_lock"
+#endif
+};
+
 void transmit_init();
 void receive_init();
 
@@ -47,6 +66,7 @@ e1000_func_enable(struct pci_func *pcif) {
 void transmit_init() {
     
     int i;
+    struct PageInfo *bufs;
     /* Allocate a region of memory for the transimit descriptor list.
      * Software should make sure this memory is aligned 
      * on a paragraph (16-byte) boundary. 
@@ -118,15 +138,14 @@ void transmit_init() {
     /* Reserve memory for memory buffers
      *     1. maximus size of an Ethernet packet is 1518 byte, there are 8 descriptors
      *     2. buffer memory should be contiguous in physical memory
-     * so
-     *     1. each page (4096 bytes) can have 2 buffers at most
-     *     2. need 4 pages for 8 descriptors
+     * so take one physically contiguous run of pages and give each
+     * descriptor a 2048-byte slice of it.
      */
-    for (i = 0; i < TX_DESC_SIZE; i = i + 2){
-        tx_desc_list[i].addr   = page2pa(page_alloc(ALLOC_ZERO));
-        tx_desc_list[i+1].addr = tx_desc_list[i].addr + PGSIZE/2;
-        //cprintf("i:%x, addr: %x\n", i, tx_desc_list[i].addr);
-        //cprintf("i+1:%x, next_addr:%x \n", i+1, tx_desc_list[i+1].addr);
+    static_assert(TX_DESC_SIZE * PKT_BUF_SZ == PGSIZE << TX_BUF_ORDER);
+    if (!(bufs = page_alloc_contig(TX_BUF_ORDER, ALLOC_ZERO)))
+        panic("transmit_init: out of memory for packet buffers");
+    for (i = 0; i < TX_DESC_SIZE; i = i + 1){
+        tx_desc_list[i].addr = page2pa(bufs) + i * PKT_BUF_SZ;
     }
 
     /* Set all the DD bit to 1
@@ -153,8 +172,9 @@ int transmit_pkt (uint16_t length, char* tx_pkt) {
     uint32_t  tail;
     uint8_t* pkt_buf;
 
-    int i;
+    int i, r;
 
+    spin_lock(&tx_lock);
     tail         = pci_e1000[E1000_TDT];
     pkt_buf      = KADDR(tx_desc_list[tail].addr);
     
@@ -179,11 +199,13 @@ int transmit_pkt (uint16_t length, char* tx_pkt) {
         pci_e1000[E1000_TDT] = (tail + 1) & TX_PTR_MSK;
 
         //cprintf("[transmit pkt]TDH, %x, TDT, %x, status: %x\n\n", pci_e1000[E1000_TDH], pci_e1000[E1000_TDT], tx_desc_list[tail].status);
-        return 0;
+        r = 0;
     }
     else {
-        return -E_TX_BUF_FULL;
+        r = -E_TX_BUF_FULL;
     }
+    spin_unlock(&tx_lock);
+    return r;
 }
 
 
@@ -191,6 +213,7 @@ int transmit_pkt (uint16_t length, char* tx_pkt) {
 void receive_init() {
 
     int i;
+    struct PageInfo *bufs;
     /* Program the Recieve address Registers (RAL/RAH) with the desired 
      * Ethernet addres
      */
@@ -260,18 +283,14 @@ void receive_init() {
     //cprintf("RCTL:%x\n", pci_e1000[E1000_RCTL]);
 
 
-    /* Reserve memory for memory buffers
-     *     1. maximus size of an Ethernet packet is 1518 byte, there are 8 descriptors
-     *     2. buffer memory should be contiguous in physical memory
-     * so
-     *     1. each page (4096 bytes) can have 2 buffers at most
-     *     2. need 4 pages for 8 descriptors
+    /* Reserve memory for memory buffers, one 2048-byte slice of a
+     * physically contiguous run of pages per descriptor, as for transmit.
      */
-    for (i = 0; i < RX_DESC_SIZE; i = i + 2){
-        rx_desc_list[i].addr   = page2pa(page_alloc(ALLOC_ZERO));
-        rx_desc_list[i+1].addr = rx_desc_list[i].addr + PGSIZE/2;
-        //cprintf("i:%x, addr: %x\n", i, rx_desc_list[i].addr);
-        //cprintf("i+1:%x, next_addr:%x \n", i+1, rx_desc_list[i+1].addr);
+    static_assert(RX_DESC_SIZE * PKT_BUF_SZ == PGSIZE << RX_BUF_ORDER);
+    if (!(bufs = page_alloc_contig(RX_BUF_ORDER, ALLOC_ZERO)))
+        panic("receive_init: out of memory for packet buffers");
+    for (i = 0; i < RX_DESC_SIZE; i = i + 1){
+        rx_desc_list[i].addr = page2pa(bufs) + i * PKT_BUF_SZ;
     }
     cprintf("Receive Initialization Done!\n");
 
@@ -282,8 +301,9 @@ int receive_pkt (uint16_t* length, char* rx_data) {
     int tail, next_tail, head;
     uint8_t* pkt_buf;
 
-    int i;
+    int i, r;
 
+    spin_lock(&rx_lock);
     tail = pci_e1000[E1000_RDT];
     head = pci_e1000[E1000_RDH];
 
@@ -300,10 +320,12 @@ int receive_pkt (uint16_t* length, char* rx_data) {
         pci_e1000[E1000_RDT] = next_tail;
 
         //cprintf("[receive_pkt]head:%x,tail:%x\n", pci_e1000[E1000_RDH], pci_e1000[E1000_RDT]);
-        return 0;
+        r = 0;
     }
     else {
-        return -E_RX_BUF_EMPTY;
+        r = -E_RX_BUF_EMPTY;
     }
+    spin_unlock(&rx_lock);
+    return r;
 
 }
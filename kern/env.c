@@ -14,10 +14,13 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/ipc.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_table_lock;	// Protects env_free_list
+static struct spinlock env_locks[NENV];	// Per-Env state, see env_lock()
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -36,7 +39,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +58,11 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_PERCPU0) are initialized
+	// in env_init_percpu()
+	[GD_PERCPU0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -109,6 +116,90 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Lock e's per-Env state: env_status, the IPC fields and the
+// page tables under env_pgdir.  Code that looked e up with envid2env()
+// must re-check e->env_id after locking, since e may have been freed
+// and reused in the meantime.
+//
+// Environments sharing an address space (sys_sfork) share one lock,
+// env_locks[env_lock_idx], which thus covers their page tables too.
+// env_lock_idx only changes under the old lock (see env_set_lock).
+void
+env_lock(struct Env *e)
+{
+	uint32_t i;
+
+	for (;;) {
+		i = e->env_lock_idx;
+		spin_lock(&env_locks[i]);
+		if (e->env_lock_idx == i)
+			return;
+		spin_unlock(&env_locks[i]);
+	}
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e->env_lock_idx]);
+}
+
+// Lock two environments in a fixed (address) order so that two CPUs
+// locking the same pair cannot deadlock.  a and b may be the same env,
+// or share a lock.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	uint32_t i, j;
+
+	for (;;) {
+		i = a->env_lock_idx;
+		j = b->env_lock_idx;
+		spin_lock(&env_locks[MIN(i, j)]);
+		if (i != j)
+			spin_lock(&env_locks[MAX(i, j)]);
+		if (a->env_lock_idx == i && b->env_lock_idx == j)
+			return;
+		if (i != j)
+			spin_unlock(&env_locks[MAX(i, j)]);
+		spin_unlock(&env_locks[MIN(i, j)]);
+	}
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	if (a->env_lock_idx != b->env_lock_idx)
+		env_unlock(b);
+	env_unlock(a);
+}
+
+// Make e use env_locks[idx] from now on.  e must not be locked.
+static void
+env_set_lock(struct Env *e, uint32_t idx)
+{
+	uint32_t old;
+
+	env_lock(e);
+	old = e->env_lock_idx;
+	e->env_lock_idx = idx;
+	spin_unlock(&env_locks[old]);
+}
+
+// Make e, which env_alloc just created, share src's address space and
+// lock (for sys_sfork).  The page directory's pp_ref counts the
+// environments using it.
+void
+env_share_vm(struct Env *e, struct Env *src)
+{
+	struct PageInfo *own = pa2page(PADDR(e->env_pgdir));
+
+	page_incref(pa2page(PADDR(src->env_pgdir)));
+	e->env_pgdir = src->env_pgdir;
+	page_decref(own);
+	env_set_lock(e, src->env_lock_idx);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -122,7 +213,10 @@ env_init(void)
 	// LAB 3: Your code here.
     int i;
     env_free_list = 0;
+    spin_initlock(&env_table_lock);
     for (i = NENV - 1; i >= 0; i--) {
+        __spin_initlock(&env_locks[i], "env_lock");
+        envs[i].env_lock_idx = i;
         envs[i].env_status = ENV_FREE;
         envs[i].env_link = env_free_list;
         env_free_list = &envs[i];
@@ -136,10 +230,21 @@ env_init(void)
 void
 env_init_percpu(void)
 {
+	int i = lapic_id();
+
+	static_assert(GD_PERCPU0 == GD_TSS0 + 8 * NCPU);
+
+	// GS selects this CPU's struct CpuInfo, for thiscpu.  Its DPL of 0
+	// makes iret clear GS on the way to user mode, so _alltraps loads
+	// it again on every trap (see trapentry.S).  This must happen
+	// before the first spinlock, whose debug code uses thiscpu.
+	cpus[i].cpu_self = &cpus[i];
+	gdt[(GD_PERCPU0 >> 3) + i] = SEG16(STA_W, (uint32_t) &cpus[i],
+					   sizeof(struct CpuInfo) - 1, 0);
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_PERCPU0 + (i << 3)));
+	// The kernel never uses FS, so we leave it set to the user data
+	// segment.
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -247,12 +352,26 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
+
+	// e may have shared another environment's lock
+	if (e->env_lock_idx != e - envs)
+		env_set_lock(e, e - envs);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
     
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -263,7 +382,6 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -293,12 +411,30 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_uxstacktop = UXSTACKTOP;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
-
-	// commit the allocation
-	env_free_list = e->env_link;
+	e->env_ipc_recv_from = 0;
+	e->env_ipc_handoff = 0;
+	e->env_ipc_msglen = 0;
+	e->env_ipc_senders.eq_head = e->env_ipc_senders.eq_tail = NULL;
+	e->env_ipc_sendq = NULL;
+	e->env_ipc_send_to = 0;
+	e->env_timer_idx = -1;
+	e->env_timer_armed = 0;
+	e->env_prio = ENV_PRIO_NORMAL;
+	e->env_weight = ENV_WEIGHT_DEFAULT;
+	e->env_affinity = ENV_AFFINITY_ALL;
+	e->env_pass = 0;
+	e->env_runtime = 0;
+
+	// commit the allocation.  The new env is not runnable until its
+	// creator has finished setting it up and calls sched_set_status().
+	env_lock(e);
+	e->env_rq = NULL;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	env_unlock(e);
 	*newenv_store = e;
 
 	//cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -333,6 +469,21 @@ region_alloc(struct Env *e, void *va, size_t len)
     }
 }
 
+//
+// Like region_alloc, but only reserve the pages as demand-zero: each
+// is allocated and zeroed when the environment first touches it.
+//
+static void
+region_reserve(struct Env *e, void *va, size_t len)
+{
+    void *i;
+
+    for (i = ROUNDDOWN(va, PGSIZE); i < ROUNDUP(va + len, PGSIZE); i+= PGSIZE) {
+        if (page_reserve(e->env_pgdir, i, PTE_U | PTE_W) != 0)
+            panic("page_reserve:out of memory\n");
+    }
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -390,7 +541,7 @@ load_icode(struct Env *e, uint8_t *binary)
     struct Elf *elf_hdr = (struct Elf*)binary;
     struct Proghdr *ph, *eph; 
     pte_t* pte_ptr;
-    uint32_t i, rounddown_offset;
+    uint32_t i, rounddown_offset, bss;
 
     if (elf_hdr->e_magic != ELF_MAGIC)
         panic("load_icode: not elf binary!");
@@ -399,8 +550,13 @@ load_icode(struct Env *e, uint8_t *binary)
     for (; ph < eph; ph++) {
         if (ph->p_type == ELF_PROG_LOAD) {
             //cprintf("1 tpye:%x, va:%x, filesz: %x, load start: %x\n", ph->p_type, ph->p_va, ph->p_filesz,binary + (ph->p_offset));
-            region_alloc(e, (void*)ph->p_va, ph->p_memsz);
-            for (i = ROUNDDOWN(ph->p_va, PGSIZE); i < ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE); i+=PGSIZE){
+            // Pages holding file data are filled in now, the rest
+            // of the bss on demand.
+            region_alloc(e, (void*)ph->p_va, ph->p_filesz);
+            bss = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+            if (ph->p_va + ph->p_memsz > bss)
+                region_reserve(e, (void*)bss, ph->p_va + ph->p_memsz - bss);
+            for (i = ROUNDDOWN(ph->p_va, PGSIZE); i < bss; i+=PGSIZE){
                 //cprintf("2:addr:%x, up:%x\n",i, ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE));
                 rounddown_offset = ph->p_va - ROUNDDOWN(ph->p_va, PGSIZE);
                 pte_ptr =  pgdir_walk(e->env_pgdir, (void*)i, 0);
@@ -470,17 +626,26 @@ env_create(uint8_t *binary, enum EnvType type)
     if (type == ENV_TYPE_FS) {
         newenv->env_tf.tf_eflags = newenv->env_tf.tf_eflags | FL_IOPL_3;
     }
+    // Every other environment depends on the servers, so they run in
+    // the real-time class.
+    if (type == ENV_TYPE_FS || type == ENV_TYPE_NS) {
+        newenv->env_prio = ENV_PRIO_SERVER;
+    }
+    env_lock(newenv);
+    sched_set_status(newenv, ENV_RUNNABLE);
+    env_unlock(newenv);
 
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold env_lock(e).
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
+	pde_t *pgdir = e->env_pgdir;
+	uint32_t pdeno;
 	physaddr_t pa;
 
 	// If freeing the current environment, switch to kern_pgdir
@@ -492,38 +657,38 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	//cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+	// Threads made by sys_sfork share the address space; the last
+	// one to go frees it.
+	e->env_pgdir = 0;
+	if (atomic_add16(&pa2page(PADDR(pgdir))->pp_ref, -1) == 1) {
+		// Flush all mapped pages in the user portion of the address space
+		static_assert(UTOP % PTSIZE == 0);
+		for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+
+			// only look at mapped page tables
+			if (!(pgdir[pdeno] & PTE_P))
+				continue;
+
+			// drop the page table, which unmaps all its PTEs unless
+			// the table is still shared with another environment
+			pa = PTE_ADDR(pgdir[pdeno]);
+			pgdir[pdeno] = 0;
+			pgtable_decref(pa2page(pa));
 		}
 
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		// free the page directory
+		page_free(pa2page(PADDR(pgdir)));
 	}
 
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
-	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+	// take it off any IPC sender queues
+	ipc_env_free(e);
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	sched_set_status(e, ENV_FREE);
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -534,15 +699,38 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+	env_lock(e);
+	env_destroy_locked(e);
+}
+
+//
+// Like env_destroy, but the caller already holds env_lock(e), having
+// checked that e is still the env it looked up.  Releases the lock.
+//
+void
+env_destroy_locked(struct Env *e)
+{
+	// Another CPU freed e first, or marked it ENV_DYING while it runs
+	// there and will free it when it traps.
+	if (e->env_status == ENV_FREE ||
+	    (e->env_status == ENV_DYING && curenv != e)) {
+		env_unlock(e);
+		return;
+	}
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
 	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+		sched_set_status(e, ENV_DYING);
+		// Its CPU may have no timer armed; make it trap now.
+		sched_kick(&cpus[e->env_cpunum]);
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -602,17 +790,22 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
     
-    if (curenv && (curenv->env_status == ENV_RUNNING)) {
-        curenv->env_status = ENV_RUNNABLE;
+    // The caller (sched_yield, or a trap returning to curenv) has
+    // already made e ENV_RUNNING on this CPU.
+    if (curenv && curenv != e) {
+        // Once requeued, curenv may be freed by another CPU, page
+        // directory and all, so leave it first.
+        lcr3(PADDR(e->env_pgdir));
+        sched_put_prev(curenv);
+    }
+    // Only a switch, or a change to our run queue or the timers since
+    // we last armed it, calls for reprogramming the LAPIC timer.
+    if (curenv != e || thiscpu->cpu_timer_stale) {
+        sched_timer_arm(1);
     }
     curenv = e;
-    curenv->env_status = ENV_RUNNING;
     curenv->env_runs += 1;
     lcr3(PADDR(curenv->env_pgdir));
-    //cprintf("[env_run]unlock\n");
-	curenv->env_cpunum = cpunum();
-    //cprintf("[env_run] old cpu: %d, new cpu:%d, id:%x\n", curenv->env_cpunum, cpunum(), curenv->env_id);
-    unlock_kernel(); 
     env_pop_tf(&(curenv->env_tf));
 
 	//panic("env_run not yet implemented");
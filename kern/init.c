@@ -16,6 +16,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/merge.h>
 
 static void boot_aps(void);
 
@@ -30,6 +31,10 @@ i386_init(void)
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
 
+	// Set up our per-CPU segment, which thiscpu (and so every
+	// spinlock) relies on.
+	env_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -38,6 +43,7 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	merge_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -46,6 +52,7 @@ i386_init(void)
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
+	sched_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
@@ -54,13 +61,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-    lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -77,6 +77,10 @@ i386_init(void)
 	ENV_CREATE(user_httpd, ENV_TYPE_USER);
 #endif // TEST*
 
+	// Starting non-boot CPUs.  The initial environments already sit
+	// on our run queue, so the APs can steal from it right away.
+	boot_aps();
+
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
@@ -122,19 +126,16 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	env_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
-	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-    lock_kernel();
+	// to start running processes on this CPU.  The scheduler does its
+	// own locking, so several CPUs may enter it at once.
 	sched_yield();
 
 	// Remove this after you finish Exercise 4
@@ -0,0 +1,143 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/ipc.h>
+
+static struct spinlock ipc_sendq_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "ipc_sendq_lock"
+#endif
+};
+
+// Senders whose receiver was freed while they were queued on it.  They
+// cannot be woken from env_free(), which holds the receiver's env_lock,
+// so ipc_wake_orphans() fails their sends from sched_yield() instead.
+static struct EnvQueue ipc_orphans;
+
+static void
+sendq_append(struct EnvQueue *q, struct Env *e)
+{
+	e->env_ipc_sendq = q;
+	e->env_ipc_send_next = NULL;
+	e->env_ipc_send_prev = q->eq_tail;
+	if (q->eq_tail)
+		q->eq_tail->env_ipc_send_next = e;
+	else
+		q->eq_head = e;
+	q->eq_tail = e;
+}
+
+static void
+sendq_unlink(struct Env *e)
+{
+	struct EnvQueue *q = e->env_ipc_sendq;
+
+	if (e->env_ipc_send_prev)
+		e->env_ipc_send_prev->env_ipc_send_next = e->env_ipc_send_next;
+	else
+		q->eq_head = e->env_ipc_send_next;
+	if (e->env_ipc_send_next)
+		e->env_ipc_send_next->env_ipc_send_prev = e->env_ipc_send_prev;
+	else
+		q->eq_tail = e->env_ipc_send_prev;
+	e->env_ipc_sendq = NULL;
+	e->env_ipc_send_next = e->env_ipc_send_prev = NULL;
+}
+
+// Remove and return the head of q, storing its env id in *idp.  The
+// env id is stable while the env is queued, since env_free() unlinks it
+// first; once the lock is dropped the caller must lock the env and
+// check the id again.
+static struct Env *
+sendq_pop(struct EnvQueue *q, envid_t *idp)
+{
+	struct Env *e;
+
+	spin_lock(&ipc_sendq_lock);
+	if ((e = q->eq_head)) {
+		*idp = e->env_id;
+		sendq_unlink(e);
+	}
+	spin_unlock(&ipc_sendq_lock);
+	return e;
+}
+
+// Queue sender 'snd' at the tail of receiver 'rcv''s sender queue.
+// The caller must hold both env locks.
+void
+ipc_sendq_push(struct Env *rcv, struct Env *snd)
+{
+	spin_lock(&ipc_sendq_lock);
+	sendq_append(&rcv->env_ipc_senders, snd);
+	spin_unlock(&ipc_sendq_lock);
+}
+
+// Return the oldest sender blocked on 'rcv', or NULL, leaving it
+// queued.  The caller must hold env_lock(rcv); to take the sender, it
+// then locks both envs and calls ipc_sendq_take.
+struct Env *
+ipc_sendq_head(struct Env *rcv)
+{
+	struct Env *e;
+
+	spin_lock(&ipc_sendq_lock);
+	e = rcv->env_ipc_senders.eq_head;
+	spin_unlock(&ipc_sendq_lock);
+	return e;
+}
+
+// Remove 'snd' from 'rcv''s sender queue if it is still the oldest
+// sender there.  Returns whether it was.  The caller must hold both
+// env locks.
+bool
+ipc_sendq_take(struct Env *rcv, struct Env *snd)
+{
+	bool r;
+
+	spin_lock(&ipc_sendq_lock);
+	if ((r = (rcv->env_ipc_senders.eq_head == snd)))
+		sendq_unlink(snd);
+	spin_unlock(&ipc_sendq_lock);
+	return r;
+}
+
+// Called by env_free() with env_lock(e) held.  Take e off whatever
+// sender queue it is blocked on, and orphan the senders blocked on e.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *s;
+
+	if (!e->env_ipc_sendq && !e->env_ipc_senders.eq_head)
+		return;
+
+	spin_lock(&ipc_sendq_lock);
+	if (e->env_ipc_sendq)
+		sendq_unlink(e);
+	while ((s = e->env_ipc_senders.eq_head)) {
+		sendq_unlink(s);
+		sendq_append(&ipc_orphans, s);
+	}
+	spin_unlock(&ipc_sendq_lock);
+}
+
+// Fail the sends of all orphaned senders with -E_BAD_ENV and make them
+// runnable again.  Must be called with no locks held.
+void
+ipc_wake_orphans(void)
+{
+	struct Env *s;
+	envid_t id;
+
+	while (ipc_orphans.eq_head && (s = sendq_pop(&ipc_orphans, &id))) {
+		env_lock(s);
+		if (s->env_id == id && s->env_ipc_send_to) {
+			s->env_ipc_send_to = 0;
+			s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			sched_set_status(s, ENV_RUNNABLE);
+		}
+		env_unlock(s);
+	}
+}
@@ -0,0 +1,24 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+// Queues of senders blocked in sys_ipc_send.  All queues, including
+// every Env's env_ipc_senders and env_ipc_sendq links, are protected by
+// a single ipc_sendq_lock, so that a sender can be unlinked without
+// holding its receiver's env_lock.  Senders are only added to or taken
+// from a receiver's queue under the receiver's env_lock as well, so a
+// receiver that finds its queue empty under that lock can block
+// without missing a sender.
+void ipc_sendq_push(struct Env *rcv, struct Env *snd);
+struct Env *ipc_sendq_head(struct Env *rcv);
+bool ipc_sendq_take(struct Env *rcv, struct Env *snd);
+void ipc_env_free(struct Env *e);
+void ipc_wake_orphans(void);
+
+#endif	// !JOS_KERN_IPC_H
@@ -1,10 +1,20 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/*
+ * Support for reading the NVRAM from the real-time clock, and for
+ * calibrating the TSC and LAPIC timer against the 8253/8254 PIT.
+ */
 
 #include <inc/x86.h>
 
 #include <kern/kclock.h>
+#include <kern/cpu.h>
+
+/* How long kclock_calibrate() measures for */
+#define	CALIBRATE_MS	10
+
+uint64_t tsc_freq;
+uint32_t lapic_timer_freq;
 
 
 unsigned
@@ -20,3 +30,45 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+/*
+ * Start PIT channel 2 counting down 'count' input clocks.  Channel 2
+ * drives the PC speaker, so nothing else uses it, and its output can
+ * be polled through port B without taking interrupts.
+ */
+static void
+pit_oneshot(uint16_t count)
+{
+	outb(IO_PORTB, (inb(IO_PORTB) & ~PORTB_SPKR) | PORTB_GATE2);
+	outb(IO_PIT+3, PIT_SEL2 | PIT_RW_LOHI | PIT_MODE0);
+	outb(IO_PIT+2, count & 0xff);
+	outb(IO_PIT+2, count >> 8);
+}
+
+static int
+pit_expired(void)
+{
+	return inb(IO_PORTB) & PORTB_OUT2;
+}
+
+/*
+ * Measure the TSC and LAPIC timer rates over CALIBRATE_MS of PIT time.
+ * The caller must have left the LAPIC timer counting down freely.
+ */
+void
+kclock_calibrate(void)
+{
+	uint64_t tsc0, tsc1;
+	uint32_t lt0, lt1;
+
+	pit_oneshot(PIT_HZ * CALIBRATE_MS / 1000);
+	tsc0 = read_tsc();
+	lt0 = lapic_timer_count();
+	while (!pit_expired())
+		;
+	tsc1 = read_tsc();
+	lt1 = lapic_timer_count();
+
+	tsc_freq = (tsc1 - tsc0) * (1000 / CALIBRATE_MS);
+	lapic_timer_freq = (lt0 - lt1) * (1000 / CALIBRATE_MS);
+}
@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -26,7 +28,27 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+#define	IO_PIT		0x040		/* 8253/8254 timer ports */
+#define	IO_PORTB	0x061		/* keyboard controller port B */
+
+#define	PIT_HZ		1193182		/* PIT input clock */
+
+/* Port B bits controlling PIT channel 2 */
+#define	PORTB_GATE2	0x01		/* channel 2 gate */
+#define	PORTB_SPKR	0x02		/* speaker data enable */
+#define	PORTB_OUT2	0x20		/* channel 2 output (read-only) */
+
+/* PIT control word fields */
+#define	PIT_SEL2	0x80		/* select channel 2 */
+#define	PIT_RW_LOHI	0x30		/* access LSB then MSB */
+#define	PIT_MODE0	0x00		/* interrupt on terminal count */
+
+/* Rates measured against the PIT by kclock_calibrate(), in Hz */
+extern uint64_t tsc_freq;
+extern uint32_t lapic_timer_freq;
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+void kclock_calibrate(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
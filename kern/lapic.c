@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -32,6 +33,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -67,12 +69,17 @@ lapic_init(void)
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// from lapic[TICR] and then issues an interrupt.
+	// The boot CPU measures that frequency against the PIT
+	// first, so that a tick is 10 ms.
 	lapicw(TDCR, X1);
+	if (thiscpu == bootcpu) {
+		lapicw(TIMER, MASKED);
+		lapicw(TICR, 0xffffffff);
+		kclock_calibrate();
+	}
 	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TICR, lapic_timer_freq ? lapic_timer_freq / 100 : 10000000);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -112,14 +119,52 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// This CPU's local APIC ID, read from the LAPIC.  Only used to find out
+// which CPU we are while setting up the per-CPU segment; everything
+// else uses cpunum(), which reads it from there.
 int
-cpunum(void)
+lapic_id(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
 	return 0;
 }
 
+// Current count of the LAPIC timer, which counts down.
+uint32_t
+lapic_timer_count(void)
+{
+	if (lapic)
+		return lapic[TCCR];
+	return 0;
+}
+
+// Switch the timer to one-shot mode and have it interrupt once, 'usec'
+// microseconds from now.  Needs the rate measured by kclock_calibrate.
+void
+lapic_timer_oneshot(uint32_t usec)
+{
+	uint64_t count;
+
+	if (!lapic || !lapic_timer_freq)
+		return;
+	count = (uint64_t) lapic_timer_freq * usec / 1000000;
+	if (count == 0)
+		count = 1;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, count);
+}
+
+// Stop the timer until it is armed again.
+void
+lapic_timer_stop(void)
+{
+	if (lapic)
+		lapicw(TICR, 0);
+}
+
 // Acknowledge interrupt.
 void
 lapic_eoi(void)
@@ -135,8 +180,6 @@ microdelay(int us)
 {
 }
 
-#define IO_RTC  0x70
-
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
@@ -187,3 +230,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -0,0 +1,256 @@
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/merge.h>
+
+// The scanner hashes every user page it can merge and looks the hash
+// up in merge_table.  A page is only ever merged into a "stable" page:
+// one that is mapped read-only or copy-on-write everywhere, marked
+// PP_MERGED, and held by a reference from the table, so that
+// page_cow_break never makes it writable in place.  Every other page
+// may change at any time, so the table only remembers it as a hint:
+// which environment had a page with that hash, and where.  When the
+// scanner finds a second page matching a hint, it write-protects that
+// page and makes it stable; the hinted page is merged into it on the
+// next pass.  Pages of zeroes are merged into the shared zero page.
+//
+// Pages in page tables shared after sys_fork, PTE_SHARE pages, and the
+// memory of environments with I/O privilege, which may hand physical
+// addresses to devices, are left alone.
+#define MERGE_NSLOT	1024
+
+struct MergeSlot {
+	uint32_t ms_hash;
+	struct PageInfo *ms_page;	// The stable page, or NULL
+	envid_t ms_env;			// Otherwise the hint: who had a page
+	uintptr_t ms_va;		// with contents hashing to ms_hash
+};
+
+static struct MergeSlot merge_table[MERGE_NSLOT];
+static uint32_t merge_zero_hash;
+
+bool merge_enabled;
+
+// Where merge_idle() resumes
+static uint32_t merge_envx;
+static uint32_t merge_pdx;
+
+static uint32_t merge_passes;		// Full passes over all envs
+static uint32_t merge_scanned;		// Pages hashed
+static uint32_t merge_merged;		// ... replaced by a stable page
+static uint32_t merge_zeroed;		// ... replaced by the zero page
+
+// Serializes scanners and protects everything above.
+static struct spinlock merge_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "merge_lock"
+#endif
+};
+
+static uint32_t
+merge_hash(const void *page)
+{
+	const uint32_t *w = page;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ w[i]) * 16777619;
+	return h;
+}
+
+void
+merge_init(void)
+{
+	merge_zero_hash = merge_hash(page2kva(zero_page));
+}
+
+// Make the writable page at *pte, mapped at 'va' in 'pgdir',
+// copy-on-write, so that its contents stay put while we compare them.
+// Returns the permissions it had.
+static int
+merge_protect(pde_t *pgdir, pte_t *pte, uintptr_t va)
+{
+	int perm = *pte & PTE_SYSCALL;
+
+	if (perm & PTE_W) {
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+		tlb_invalidate(pgdir, (void *) va);
+	}
+	return perm;
+}
+
+static void
+merge_page(pde_t *pgdir, envid_t envid, uintptr_t va, pte_t *pte)
+{
+	struct PageInfo *pp, *target = NULL;
+	struct MergeSlot *s;
+	uint32_t h;
+	int perm;
+
+	if ((*pte & (PTE_P | PTE_U | PTE_SHARE | PTE_PWT | PTE_PCD)) !=
+	    (PTE_P | PTE_U) || PGNUM(PTE_ADDR(*pte)) >= npages)
+		return;
+	pp = pa2page(PTE_ADDR(*pte));
+	if (pp == zero_page || (pp->pp_flags & PP_MERGED) || pp->pp_ref != 1)
+		return;
+
+	merge_scanned++;
+	h = merge_hash(page2kva(pp));
+	s = &merge_table[h % MERGE_NSLOT];
+	if (h == merge_zero_hash)
+		target = zero_page;
+	else if (s->ms_page && s->ms_hash == h)
+		target = s->ms_page;
+
+	if (target) {
+		perm = merge_protect(pgdir, pte, va);
+		if (memcmp(page2kva(target), page2kva(pp), PGSIZE) != 0) {
+			// A hash collision: give the page its rights back
+			*pte = PTE_ADDR(*pte) | perm;
+			return;
+		}
+		if (perm & PTE_W)
+			perm = (perm & ~PTE_W) | PTE_COW;
+		// The page table is there and not shared, so this can't fail
+		page_insert(pgdir, target, (void *) va, perm);
+		if (target == zero_page)
+			merge_zeroed++;
+		else
+			merge_merged++;
+		return;
+	}
+
+	if (s->ms_page)
+		return;
+	if (s->ms_env && s->ms_hash == h &&
+	    (s->ms_env != envid || s->ms_va != va)) {
+		merge_protect(pgdir, pte, va);
+		pp->pp_flags |= PP_MERGED;
+		page_incref(pp);
+		s->ms_page = pp;
+	} else {
+		s->ms_hash = h;
+		s->ms_env = envid;
+		s->ms_va = va;
+	}
+}
+
+// Scan up to 'ntables' page tables of e, starting at page directory
+// index *pdx, and advance *pdx past them.  Returns how many it scanned.
+static int
+merge_env(struct Env *e, uint32_t *pdx, int ntables)
+{
+	pde_t *pgdir;
+	pte_t *pt;
+	uint32_t ptx;
+	int n = 0;
+
+	if (e->env_status == ENV_FREE) {
+		*pdx = PDX(UTOP);
+		return 0;
+	}
+	env_lock(e);
+	pgdir = e->env_pgdir;
+	if (e->env_status == ENV_FREE || !pgdir ||
+	    (e->env_tf.tf_eflags & FL_IOPL_MASK))
+		*pdx = PDX(UTOP);
+	for (; *pdx < PDX(UTOP) && n < ntables; (*pdx)++) {
+		if ((pgdir[*pdx] & (PTE_P | PTE_COW)) != PTE_P)
+			continue;
+		pt = KADDR(PTE_ADDR(pgdir[*pdx]));
+		for (ptx = 0; ptx < NPTENTRIES; ptx++)
+			if (pt[ptx] & PTE_P)
+				merge_page(pgdir, e->env_id,
+					   (uintptr_t) PGADDR(*pdx, ptx, 0),
+					   &pt[ptx]);
+		n++;
+	}
+	env_unlock(e);
+	return n;
+}
+
+// Drop the stable pages that only merge_table still holds.  No one
+// maps them, so no one can start to.
+static void
+merge_sweep(void)
+{
+	struct MergeSlot *s;
+
+	for (s = merge_table; s < merge_table + MERGE_NSLOT; s++) {
+		if (s->ms_page && s->ms_page->pp_ref == 1) {
+			s->ms_page->pp_flags &= ~PP_MERGED;
+			page_decref(s->ms_page);
+			s->ms_page = NULL;
+			s->ms_env = 0;
+		}
+	}
+}
+
+void
+merge_scan(void)
+{
+	uint32_t i, pdx;
+
+	spin_lock(&merge_lock);
+	merge_sweep();
+	for (i = 0; i < NENV; i++) {
+		pdx = 0;
+		merge_env(&envs[i], &pdx, PDX(UTOP));
+	}
+	merge_passes++;
+	spin_unlock(&merge_lock);
+}
+
+// Scan one page table, for a CPU with nothing else to do (see
+// sched_halt).  Returns false if merging is off or another CPU is
+// already at it.
+bool
+merge_idle(void)
+{
+	int i, n = 0;
+
+	if (!merge_enabled || merge_lock.locked)
+		return 0;
+	spin_lock(&merge_lock);
+	for (i = 0; i < NENV && n == 0; i++) {
+		n = merge_env(&envs[merge_envx], &merge_pdx, 1);
+		if (merge_pdx < PDX(UTOP))
+			continue;
+		merge_pdx = 0;
+		if (++merge_envx == NENV) {
+			merge_envx = 0;
+			merge_sweep();
+			merge_passes++;
+		}
+	}
+	spin_unlock(&merge_lock);
+	return n > 0;
+}
+
+void
+merge_print_stats(void)
+{
+	struct MergeSlot *s;
+	uint32_t nstable = 0, saved = 0;
+
+	spin_lock(&merge_lock);
+	for (s = merge_table; s < merge_table + MERGE_NSLOT; s++) {
+		if (s->ms_page) {
+			nstable++;
+			// One reference is the table's, one the page's own
+			if (s->ms_page->pp_ref > 2)
+				saved += s->ms_page->pp_ref - 2;
+		}
+	}
+	cprintf("merging %s; %u passes, %u pages hashed\n",
+		merge_enabled ? "on" : "off", merge_passes, merge_scanned);
+	cprintf("merged %u pages into stable pages, %u into the zero page\n",
+		merge_merged, merge_zeroed);
+	cprintf("%u stable pages now save %u pages (%u KB)\n",
+		nstable, saved, saved * PGSIZE / 1024);
+	spin_unlock(&merge_lock);
+}
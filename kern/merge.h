@@ -0,0 +1,22 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_MERGE_H
+#define JOS_KERN_MERGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Same-page merging: map user pages with identical contents to a
+// single copy-on-write page.  merge_scan() makes a full pass over all
+// environments; idle CPUs call merge_idle() to scan a little at a time
+// while merge_enabled is set.
+extern bool merge_enabled;
+
+void merge_init(void);
+void merge_scan(void);
+bool merge_idle(void);
+void merge_print_stats(void);
+
+#endif	// !JOS_KERN_MERGE_H
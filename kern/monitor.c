@@ -11,6 +11,8 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/merge.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,7 +27,10 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
-    { "backtrace", "Display backtrace of all stack frames", mon_backtrace}
+    { "backtrace", "Display backtrace of all stack frames", mon_backtrace},
+	{ "pgstat", "Display page allocator statistics", mon_pgstat },
+	{ "merge", "Merge identical pages now, or turn idle merging on/off",
+	  mon_merge },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -87,6 +92,30 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_pgstat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	return 0;
+}
+
+int
+mon_merge(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		merge_enabled = 1;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		merge_enabled = 0;
+	else if (argc == 1)
+		merge_scan();
+	else {
+		cprintf("usage: merge [on|off]\n");
+		return 0;
+	}
+	merge_print_stats();
+	return 0;
+}
+
 
 
 /***** Kernel monitor command interpreter *****/
@@ -10,6 +10,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,6 +21,85 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+static size_t page_nfree;		// Number of free pages, not cached
+
+// Buddy allocator.  Once mem_init is done, free pages live in blocks of
+// 2^order contiguous, naturally aligned pages, with one free list per
+// order linked through pp_link and pp_prev.  The first page of a free
+// block has pp_order set to its order; all other pages have
+// PAGE_ORDER_NONE.  A freed block is merged with its buddy, the other
+// half of the block of the next order up, for as long as that buddy is
+// free too.
+#define PAGE_ORDER_NONE		0xFF
+static struct PageInfo *page_free_area[PAGE_MAX_ORDER + 1];
+
+// Protects page_free_list, page_free_area and page_nfree.  pp_ref
+// counts are updated atomically instead.
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+
+// Per-CPU caches of free pages ("magazines") in front of the buddy lists,
+// so that most page_alloc and page_free calls stay on the calling CPU's
+// own cache line instead of fighting over page_lock.  A CPU that finds
+// its cache empty takes PAGE_CACHE_BATCH pages from the buddy lists at
+// once, and one that finds it full gives PAGE_CACHE_BATCH back.  Each
+// cache has a lock, which only its own CPU normally takes; others take
+// it only to reclaim cached pages when free memory runs out.
+#define PAGE_CACHE_MAX		64
+#define PAGE_CACHE_BATCH	32
+
+struct PageCache {
+	struct spinlock pc_lock;
+	struct PageInfo *pc_list;	// Cached free pages, linked by pp_link
+	uint32_t pc_count;		// Number of pages on pc_list
+
+	// Statistics, for the monitor's "pgstat" command
+	uint32_t pc_allocs;		// page_alloc calls
+	uint32_t pc_hits;		// ... served without page_lock
+	uint32_t pc_frees;		// page_free calls
+	uint32_t pc_refills;		// Batches taken from the buddy lists
+	uint32_t pc_drains;		// Batches given back to them
+	uint32_t pc_fails;		// page_alloc calls that found no memory
+} __attribute__((aligned(CPU_CACHE_LINE)));
+
+static struct PageCache page_caches[NCPU];
+
+// Pool of free pages that idle CPUs have already zeroed (see
+// page_zero_idle), so that page_alloc(ALLOC_ZERO) rarely has to clear a
+// page on the critical path of a fault or system call.  Idle CPUs only
+// fill it while plenty of other memory is free.
+#define PAGE_ZERO_POOL_MAX	256
+#define PAGE_ZERO_MIN_FREE	(4 * PAGE_ZERO_POOL_MAX)
+
+static struct PageInfo *page_zero_list;	// Zeroed pages, linked by pp_link
+static uint32_t page_zero_count;	// Number of pages on page_zero_list
+static uint32_t page_zero_hits;		// ALLOC_ZERO served from the pool
+static uint32_t page_zero_misses;	// ALLOC_ZERO that had to memset
+static uint32_t page_zero_filled;	// Pages zeroed by idle CPUs
+
+static struct spinlock page_zero_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_zero_lock"
+#endif
+};
+
+// The shared zero page.  Demand-zero pages that are read before they
+// are written all map it, copy-on-write, until the first write (see
+// page_fault_in).  The kernel keeps a reference of its own, so
+// page_cow_break always replaces it rather than making it writable.
+struct PageInfo *zero_page;
+static uint32_t zero_page_maps;		// Read faults served by it
+static uint32_t zero_page_breaks;	// Writes that replaced it
+
+// Set once mem_init's checks, which manipulate page_free_list directly,
+// are done.  Until then every page goes straight to page_free_list,
+// without the buddy lists or the per-CPU caches.
+static bool page_buddy_on;
+
+static void page_buddy_init(void);
 
 
 // --------------------------------------------------------------
@@ -61,6 +142,7 @@ i386_detect_memory(void)
 
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void tlb_page_release(struct PageInfo *pp);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -160,6 +242,8 @@ mem_init(void)
 	// Your code goes here:
     pages = (struct PageInfo*)boot_alloc(npages*sizeof(struct PageInfo));
     envs = (struct Env*)boot_alloc(NENV*sizeof(struct Env));
+    timeinfo = (struct TimeInfo*)boot_alloc(PGSIZE);
+    memset(timeinfo, 0, PGSIZE);
     memset(pages, 0, npages*sizeof(struct PageInfo));
 
     //cprintf("4\n");
@@ -214,6 +298,12 @@ mem_init(void)
         page_insert(kern_pgdir, pa2page(PADDR(envs)+i), envs+i, 0x0);
     }
 
+	//////////////////////////////////////////////////////////////////////
+	// Map the kernel clock read-only by the user at UTIME, just above
+	// the envs array, so that reading the time needs no system call.
+    static_assert(NENV*sizeof(struct Env) <= UTIME - UENVS);
+    page_insert(kern_pgdir, pa2page(PADDR(timeinfo)), (void*)UTIME, PTE_U);
+
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -273,6 +363,13 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// From now on, use the buddy lists and the per-CPU page caches.
+	page_buddy_init();
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref = 1;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -372,16 +469,225 @@ page_init(void)
         pages[i].pp_link = NULL;
     }
 
-    // currently used memory, kernel, pgdir and free list
-    uint32_t next_free = (uint32_t)pages - KERNBASE 
-                         + ROUNDUP(sizeof(struct PageInfo)*npages, PGSIZE)
-                         + ROUNDUP(sizeof(struct Env)*NENV, PGSIZE);
+    // currently used memory: the kernel and everything boot_alloc
+    // handed out (pgdir, pages, envs, the time page)
+    uint32_t next_free = PADDR(boot_alloc(0));
     //cprintf("info: pages %x, next_free:%x\n", pages, next_free);
     for (i = EXTPHYSMEM/PGSIZE; i < next_free/PGSIZE; i++) {
         pages[i].pp_ref  = 1;
         pages[i].pp_link = NULL;
     }
     pages[next_free/PGSIZE].pp_link = &pages[npages_basemem-1];
+
+    struct PageInfo *pp;
+    for (pp = page_free_list; pp; pp = pp->pp_link) {
+        page_nfree++;
+    }
+}
+
+// Unlink the free block headed by pp from the order 'order' list.
+static void
+buddy_remove(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_order = PAGE_ORDER_NONE;
+}
+
+// Push the free block headed by pp onto the order 'order' list.
+static void
+buddy_insert(struct PageInfo *pp, int order)
+{
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+	pp->pp_order = order;
+}
+
+// Take a free block of 2^order pages, splitting a larger one if need
+// be, or return NULL.  page_lock must be held.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER && !page_free_area[k]; k++)
+		;
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+	pp = page_free_area[k];
+	buddy_remove(pp, k);
+	// Give back the upper half until the block is the right size.
+	while (k > order) {
+		k--;
+		buddy_insert(pp + (1 << k), k);
+	}
+	page_nfree -= 1 << order;
+	return pp;
+}
+
+// Free the block of 2^order pages starting at pp, merging it with its
+// buddies.  page_lock must be held.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, b;
+
+	page_nfree += 1 << order;
+	while (order < PAGE_MAX_ORDER) {
+		b = i ^ (1 << order);
+		if (b >= npages || pages[b].pp_order != order)
+			break;
+		buddy_remove(&pages[b], order);
+		i &= ~(1 << order);
+		order++;
+	}
+	buddy_insert(&pages[i], order);
+}
+
+// Move the pages left on page_free_list by mem_init into the buddy
+// lists, and start using those and the per-CPU caches.
+static void
+page_buddy_init(void)
+{
+	struct PageInfo *pp;
+	size_t i;
+
+	for (i = 0; i < npages; i++)
+		pages[i].pp_order = PAGE_ORDER_NONE;
+	page_nfree = 0;
+	while ((pp = page_free_list)) {
+		page_free_list = pp->pp_link;
+		buddy_free(pp, 0);
+	}
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&page_caches[i].pc_lock, "pc_lock");
+	page_buddy_on = 1;
+}
+
+// Move up to n free pages to the front of *list, and return how many
+// were moved.
+static uint32_t
+page_list_take(struct PageInfo **list, uint32_t n)
+{
+	struct PageInfo *pp;
+	uint32_t i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++) {
+		if (page_buddy_on)
+			pp = buddy_alloc(0);
+		else if ((pp = page_free_list)) {
+			page_free_list = pp->pp_link;
+			page_nfree--;
+		}
+		if (!pp)
+			break;
+		pp->pp_link = *list;
+		*list = pp;
+	}
+	spin_unlock(&page_lock);
+	return i;
+}
+
+// Free n pages from the front of *list.
+static void
+page_list_give(struct PageInfo **list, uint32_t n)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (n-- > 0) {
+		pp = *list;
+		*list = pp->pp_link;
+		if (page_buddy_on) {
+			buddy_free(pp, 0);
+		} else {
+			pp->pp_link = page_free_list;
+			page_free_list = pp;
+			page_nfree++;
+		}
+	}
+	spin_unlock(&page_lock);
+}
+
+// Give every CPU's cached pages and the pre-zeroed pool back to the
+// buddy lists, so that allocations do not fail while free pages sit
+// elsewhere.
+static void
+page_reclaim(void)
+{
+	struct PageCache *pc;
+	struct PageInfo *list;
+	uint32_t n;
+
+	spin_lock(&page_zero_lock);
+	list = page_zero_list;
+	n = page_zero_count;
+	page_zero_list = NULL;
+	page_zero_count = 0;
+	spin_unlock(&page_zero_lock);
+	if (n)
+		page_list_give(&list, n);
+
+	for (pc = page_caches; pc < page_caches + ncpu; pc++) {
+		if (pc->pc_count == 0)
+			continue;
+		spin_lock(&pc->pc_lock);
+		page_list_give(&pc->pc_list, pc->pc_count);
+		pc->pc_count = 0;
+		spin_unlock(&pc->pc_lock);
+	}
+}
+
+// Take a page from this CPU's cache, refilling it from the buddy lists
+// if it is empty.  Returns NULL if both are empty.
+static struct PageInfo *
+page_cache_alloc(void)
+{
+	struct PageCache *pc = &page_caches[cpunum()];
+	struct PageInfo *pp;
+
+	spin_lock(&pc->pc_lock);
+	pc->pc_allocs++;
+	if (pc->pc_list)
+		pc->pc_hits++;
+	else if ((pc->pc_count = page_list_take(&pc->pc_list,
+						PAGE_CACHE_BATCH)))
+		pc->pc_refills++;
+	if ((pp = pc->pc_list)) {
+		pc->pc_list = pp->pp_link;
+		pc->pc_count--;
+	}
+	spin_unlock(&pc->pc_lock);
+	return pp;
+}
+
+// Put pp in this CPU's cache, giving a batch of pages back to the buddy
+// lists if it is full.
+static void
+page_cache_free(struct PageInfo *pp)
+{
+	struct PageCache *pc = &page_caches[cpunum()];
+
+	spin_lock(&pc->pc_lock);
+	pc->pc_frees++;
+	pp->pp_link = pc->pc_list;
+	pc->pc_list = pp;
+	if (++pc->pc_count > PAGE_CACHE_MAX) {
+		page_list_give(&pc->pc_list, PAGE_CACHE_BATCH);
+		pc->pc_count -= PAGE_CACHE_BATCH;
+		pc->pc_drains++;
+	}
+	spin_unlock(&pc->pc_lock);
 }
 
 //
@@ -401,17 +707,41 @@ page_alloc(int alloc_flags)
 {
 	// Fill this function in
     //cprintf("[page_alloc]pages:%x, page_free_list:%x\n", pages, page_free_list);
-    struct PageInfo *alloc_pageinfo; 
-    if (page_free_list != NULL) {
-        alloc_pageinfo          = page_free_list;
-        page_free_list          = page_free_list->pp_link;
-        alloc_pageinfo->pp_link = NULL;
+    struct PageInfo *alloc_pageinfo = NULL;
+    if ((alloc_flags & ALLOC_ZERO) && page_zero_count > 0) {
+        spin_lock(&page_zero_lock);
+        if ((alloc_pageinfo = page_zero_list)) {
+            page_zero_list = alloc_pageinfo->pp_link;
+            page_zero_count--;
+            page_zero_hits++;
+        }
+        spin_unlock(&page_zero_lock);
+        if (alloc_pageinfo) {
+            alloc_pageinfo->pp_link = NULL;
+            return alloc_pageinfo;
+        }
+    }
+    if (page_buddy_on) {
+        if (!(alloc_pageinfo = page_cache_alloc())) {
+            page_reclaim();
+            alloc_pageinfo = page_cache_alloc();
+        }
+        if (!alloc_pageinfo) {
+            page_caches[cpunum()].pc_fails++;
+        }
     }
     else {
+        page_list_take(&alloc_pageinfo, 1);
+    }
+    if (alloc_pageinfo == NULL) {
         return NULL;
     }
+    alloc_pageinfo->pp_link = NULL;
     if (alloc_flags & ALLOC_ZERO) {
         memset(page2kva(alloc_pageinfo), 0, PGSIZE);
+        if (page_buddy_on) {
+            atomic_add(&page_zero_misses, 1);
+        }
     }
     return alloc_pageinfo;
 	//return 0;
@@ -428,14 +758,86 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
-    //cprintf("enter: free: %x\n",pp);
-    if (pp->pp_ref == 0 && pp->pp_link == NULL) {
-        pp->pp_link    = page_free_list; 
-        page_free_list = pp;
-    }
-    else {
-        panic("pp_ref is not ZERO or pp_link is not NULL!\n");
-    }
+	if (pp->pp_ref != 0 || pp->pp_link != NULL)
+		panic("pp_ref is not ZERO or pp_link is not NULL!\n");
+	pp->pp_flags = 0;
+	if (page_buddy_on)
+		page_cache_free(pp);
+	else
+		page_list_give(&pp, 1);
+}
+
+// Zero one free page and add it to the pre-zeroed pool, for a CPU with
+// nothing else to do (see sched_halt).  Returns false if the pool is
+// full or memory is too short to set pages aside.
+bool
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+
+	if (!page_buddy_on || page_zero_count >= PAGE_ZERO_POOL_MAX ||
+	    page_nfree < PAGE_ZERO_MIN_FREE)
+		return 0;
+	if (!(pp = page_alloc(0)))
+		return 0;
+	memset(page2kva(pp), 0, PGSIZE);
+	spin_lock(&page_zero_lock);
+	pp->pp_link = page_zero_list;
+	page_zero_list = pp;
+	page_zero_count++;
+	page_zero_filled++;
+	spin_unlock(&page_zero_lock);
+	return 1;
+}
+
+//
+// Allocates 2^order physically contiguous pages, the first of which is
+// aligned to their total size, for device DMA.  ALLOC_ZERO works as for
+// page_alloc.  The pages are returned as independent pages: each has
+// its own reference count and is freed with page_free or page_decref
+// once it drops to zero.
+//
+// Returns NULL if there is no free run that large, if order exceeds
+// PAGE_MAX_ORDER, or if called before mem_init is done.
+//
+struct PageInfo *
+page_alloc_contig(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int i, try;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order > PAGE_MAX_ORDER || !page_buddy_on)
+		return NULL;
+	// Pages sitting in the per-CPU caches cannot merge, so give them
+	// back and try again before failing.
+	for (try = 0; try < 2; try++) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+		if (pp || try)
+			break;
+		page_reclaim();
+	}
+	if (!pp)
+		return NULL;
+	for (i = 0; i < (1 << order); i++)
+		pp[i].pp_link = NULL;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Increment the reference count on a page.  Pages can be mapped into
+// several environments, so this must be atomic with respect to
+// page_decref on other CPUs.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	atomic_add16(&pp->pp_ref, 1);
 }
 
 //
@@ -445,10 +847,49 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (atomic_add16(&pp->pp_ref, -1) == 1)
 		page_free(pp);
 }
 
+// Print the page allocator's statistics: free pages, and what each
+// CPU's page cache holds and has done.
+void
+page_print_stats(void)
+{
+	struct PageCache *pc;
+	struct PageInfo *pp;
+	size_t cached = 0, n;
+	int i;
+
+	cprintf("CPU  cached   allocs     hits    frees  refills   drains  fails\n");
+	for (pc = page_caches; pc < page_caches + ncpu; pc++) {
+		cprintf("%3d %7u %8u %8u %8u %8u %8u %6u\n",
+			pc - page_caches, pc->pc_count, pc->pc_allocs,
+			pc->pc_hits, pc->pc_frees, pc->pc_refills,
+			pc->pc_drains, pc->pc_fails);
+		cached += pc->pc_count;
+	}
+	cprintf("free pages: %u in the buddy lists + %u cached "
+		"+ %u pre-zeroed, of %u\n",
+		page_nfree, cached, page_zero_count, npages);
+	cprintf("zeroed allocations: %u from the pool, %u cleared on demand; "
+		"%u zeroed while idle\n",
+		page_zero_hits, page_zero_misses, page_zero_filled);
+	cprintf("zero page: in %u page tables; %u read faults served, "
+		"%u replaced on write\n", zero_page->pp_ref - 1,
+		zero_page_maps, zero_page_breaks);
+
+	cprintf("free blocks by order:");
+	spin_lock(&page_lock);
+	for (i = 0; i <= PAGE_MAX_ORDER; i++) {
+		for (n = 0, pp = page_free_area[i]; pp; pp = pp->pp_link)
+			n++;
+		cprintf(" %u", n);
+	}
+	spin_unlock(&page_lock);
+	cprintf("\n");
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -479,6 +920,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     pte_t *  pte_ptr;
     struct PageInfo * created_pageinfo;
     if (pgdir[PDX(va)] & PTE_P) {
+        // Whoever may create an entry is about to change the table
+        if (create && pgdir_unshare(pgdir, va) < 0) {
+            return NULL;
+        }
         entry_pgtable = (pte_t*)KADDR(PTE_ADDR(pgdir[PDX(va)]));
         pte_ptr       = entry_pgtable + PTX(va);
         //cprintf("[pgdir_walk]va:%x, pte_ptr:%x\n", va, pte_ptr);
@@ -557,14 +1002,21 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
     pte_t * pte_ptr;
-    uint32_t incr;
+    struct PageInfo * old;
     if ((pte_ptr  = pgdir_walk(pgdir, va, 1))) {
-        incr = (((*pte_ptr) & (~0xfff)) != page2pa(pp));
-        if((*pte_ptr & PTE_P) && incr) {
-            page_remove(pgdir, va);
+        old = (*pte_ptr & PTE_P) ? pa2page(PTE_ADDR(*pte_ptr)) : NULL;
+        if (old != pp) {
+            page_incref(pp);
         }
+        // Replace the old entry in one go: another CPU running this
+        // address space must never see it unmapped.
         *pte_ptr = page2pa(pp) | perm | PTE_P;
-        pp->pp_ref += incr;
+        if (old) {
+            tlb_invalidate(pgdir, va);
+            if (old != pp) {
+                tlb_page_release(old);
+            }
+        }
         //cprintf("[page_insert] va:%x, content:%x, pp_ref:%x\n", va, *pte_ptr, pp->pp_ref);
 	    return 0;
     }
@@ -622,31 +1074,458 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
+// If the page table covering 'va' may be shared since sys_fork, the
+// caller must split it first with pgdir_unshare, which can fail.
+//
 void
 page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
     struct PageInfo * pp;
-    pte_t * removed_pte_ptr;
+    pte_t * removed_pte_ptr = NULL;
+    // Callers split a shared page table beforehand, so this cannot
+    // need memory unless one of them forgot.
+    if ((removed_pte_ptr = pgdir_walk(pgdir, va, 0)) && *removed_pte_ptr &&
+        pgdir_unshare(pgdir, va) < 0) {
+        panic("page_remove: no memory to split a page table");
+    }
+    removed_pte_ptr = NULL;
     if ((pp = page_lookup(pgdir, va, &removed_pte_ptr))) {
         //cprintf("[page_remove]pp:%x ref:%d, va:%x\n",pp, pp->pp_ref, va);
-        page_decref(pp);
         *removed_pte_ptr = 0x0;
         tlb_invalidate(pgdir, va);
+        tlb_page_release(pp);
         //cprintf("ref:%d, va:%x\n",pp->pp_ref, page2kva(pp));
     }
+    else if (removed_pte_ptr) {
+        // Drop a demand-zero reservation; the TLB never caches it.
+        *removed_pte_ptr = 0x0;
+    }
+}
+
+//
+// Reserve the page at 'va' in 'pgdir' as demand-zero with permission
+// 'perm' (as for page_insert), unmapping whatever was there.  No page
+// is allocated until page_fault_in.  Returns 0, or -E_NO_MEM if a page
+// table couldn't be allocated.  The caller must hold the lock of the
+// environment that owns pgdir.
+//
+int
+page_reserve(pde_t *pgdir, void *va, int perm)
+{
+	pte_t *pte;
+
+	if (pgdir_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+	page_remove(pgdir, va);
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+		return -E_NO_MEM;
+	*pte = (perm & ~PTE_P) | PTE_ZERO;
+	return 0;
+}
+
+//
+// Map a zero-filled page at 'va' in 'pgdir' if the page is reserved
+// demand-zero (see page_reserve).  Unless 'write' is set or the page
+// is PTE_SHARE, that is the shared zero page, mapped copy-on-write if
+// the reservation is writable.  Returns 1 if the page is mapped on
+// return, which includes another thread having filled it first, 0 if
+// it is neither mapped nor reserved, or -E_NO_MEM.  The caller must
+// hold the lock of the environment that owns pgdir.
+//
+int
+page_fault_in(pde_t *pgdir, void *va, bool write)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(pte = pgdir_walk(pgdir, va, 0)))
+		return 0;
+	if (*pte & PTE_P)
+		return 1;
+	if (!(*pte & PTE_ZERO))
+		return 0;
+	perm = *pte & PTE_SYSCALL;
+	if (!write && !(perm & PTE_SHARE)) {
+		if (perm & PTE_W)
+			perm = (perm & ~PTE_W) | PTE_COW;
+		if (page_insert(pgdir, zero_page, va, perm) < 0)
+			return -E_NO_MEM;
+		atomic_add(&zero_page_maps, 1);
+		return 1;
+	}
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if (page_insert(pgdir, pp, va, perm) < 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+	return 1;
+}
+
+//
+// Drop a reference to the page table page 'pt'.  Whoever drops the last
+// one also drops the table's references to the pages it maps.
+//
+void
+pgtable_decref(struct PageInfo *pt)
+{
+	pte_t *pte = page2kva(pt);
+	size_t ptx;
+
+	if (atomic_add16(&pt->pp_ref, -1) != 1)
+		return;
+	for (ptx = 0; ptx < NPTENTRIES; ptx++)
+		if (pte[ptx] & PTE_P)
+			page_decref(pa2page(PTE_ADDR(pte[ptx])));
+	page_free(pt);
+}
+
+//
+// After sys_fork, the parent and child share their page tables below
+// UTOP: both page directory entries point at the same table, marked
+// PTE_COW and read-only, so that any write into the 4MB region faults.
+// Each page mapped by a shared table counts one reference for the
+// table, however many address spaces use it.
+//
+// Give 'pgdir' its own copy of the page table covering 'va' if it
+// shares it.  The writable pages it maps become copy-on-write in both
+// copies, except PTE_SHARE ones.  If no one else uses the table any
+// more, it is simply made writable again.  Returns 1 if the table was
+// shared, 0 if not, or -E_NO_MEM.  The caller must hold the lock of the
+// environment that owns pgdir.
+//
+int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *old, *new;
+	pte_t *src, *dst;
+	size_t ptx;
+
+	if ((*pde & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+	old = pa2page(PTE_ADDR(*pde));
+	if (old->pp_ref > 1) {
+		if (!(new = page_alloc(0)))
+			return -E_NO_MEM;
+		// Other sharers may be copying the table at the same time;
+		// they make the same changes to it.
+		src = page2kva(old);
+		dst = page2kva(new);
+		for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+			if ((src[ptx] & (PTE_P | PTE_W | PTE_SHARE)) ==
+			    (PTE_P | PTE_W))
+				src[ptx] = (src[ptx] & ~PTE_W) | PTE_COW;
+			dst[ptx] = src[ptx];
+			if (dst[ptx] & PTE_P)
+				page_incref(pa2page(PTE_ADDR(dst[ptx])));
+		}
+		page_incref(new);
+		*pde = page2pa(new) | PTE_U | PTE_W | PTE_P;
+		// No CPU may still walk the old table when it is freed.
+		tlb_flush(pgdir);
+		pgtable_decref(old);
+	} else {
+		*pde = (*pde & ~PTE_COW) | PTE_W;
+		tlb_invalidate_local(pgdir, NULL);
+	}
+	return 1;
+}
+
+//
+// Make a write to 'va' in 'pgdir' possible if all that stands in the
+// way is copy-on-write sharing: split a shared page table (see
+// pgdir_unshare), and if the page itself is copy-on-write (PTE_COW),
+// give this address space its own writable copy of it, or just make it
+// writable if no one else maps the page any more.  Returns 1 if it did
+// any of that, 0 if there was nothing to do, or -E_NO_MEM.  The caller
+// must hold the lock of the environment that owns pgdir.
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((r = pgdir_unshare(pgdir, va)) < 0)
+		return r;
+	if (!(pte = pgdir_walk(pgdir, va, 0)))
+		return r;
+	if ((*pte & (PTE_P | PTE_U | PTE_W)) == (PTE_P | PTE_U | PTE_W) &&
+	    (pgdir[PDX(va)] & PTE_W)) {
+		// Another CPU running this address space made the page
+		// writable after this one cached it read-only.
+		tlb_invalidate_local(pgdir, va);
+		return 1;
+	}
+	if ((*pte & (PTE_P | PTE_U | PTE_W | PTE_COW)) !=
+	    (PTE_P | PTE_U | PTE_COW))
+		return r;
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp == zero_page) {
+		// Nothing to copy
+		if (!(copy = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		if (page_insert(pgdir, copy, va, perm) < 0) {
+			page_free(copy);
+			return -E_NO_MEM;
+		}
+		atomic_add(&zero_page_breaks, 1);
+		return 1;
+	}
+	if (pp->pp_ref == 1) {
+		// Other CPUs' read-only entries just cause a spurious fault.
+		// No one else can see the page, so it stops being merged.
+		pp->pp_flags &= ~PP_MERGED;
+		*pte = PTE_ADDR(*pte) | perm;
+		tlb_invalidate_local(pgdir, va);
+		return 1;
+	}
+	// The copy overwrites the whole page.
+	if (!(copy = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(copy), page2kva(pp), PGSIZE);
+	if (page_insert(pgdir, copy, va, perm) < 0) {
+		page_free(copy);
+		return -E_NO_MEM;
+	}
+	return 1;
+}
+
+//
+// Copy the user part of the address space 'src' into the empty 'dst',
+// for sys_fork.  Page tables are shared (see pgdir_unshare), so this
+// costs one step per page directory entry, except for the region
+// holding the stacks, which is written to right away: there, shared
+// (PTE_SHARE) and read-only pages are mapped into dst as they are, and
+// writable pages become copy-on-write in both.  The user exception
+// stack is left out.  Returns 0, or -E_NO_MEM with dst partly filled.
+// The caller must flush src's TLB, and hold the locks of both
+// environments.
+//
+int
+pgdir_copy_cow(pde_t *src, pde_t *dst)
+{
+	pte_t *pt;
+	uintptr_t va;
+	size_t pdx, ptx;
+	int perm, r;
+
+	for (pdx = 0; pdx < PDX(UTOP); pdx++) {
+		if (!(src[pdx] & PTE_P))
+			continue;
+		if (pdx != PDX(UXSTACKTOP - PGSIZE)) {
+			src[pdx] = (src[pdx] & ~PTE_W) | PTE_COW;
+			dst[pdx] = src[pdx];
+			page_incref(pa2page(PTE_ADDR(src[pdx])));
+			continue;
+		}
+		if ((r = pgdir_unshare(src, (void *) PGADDR(pdx, 0, 0))) < 0)
+			return r;
+		pt = KADDR(PTE_ADDR(src[pdx]));
+		for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+			va = (uintptr_t) PGADDR(pdx, ptx, 0);
+			if (va == UXSTACKTOP - PGSIZE)
+				continue;
+			if (!(pt[ptx] & PTE_P)) {
+				if ((pt[ptx] & PTE_ZERO) &&
+				    (r = page_reserve(dst, (void *) va,
+						      pt[ptx] & PTE_SYSCALL)) < 0)
+					return r;
+				continue;
+			}
+			if ((pt[ptx] & (PTE_W | PTE_SHARE)) == PTE_W)
+				pt[ptx] = (pt[ptx] & ~PTE_W) | PTE_COW;
+			perm = pt[ptx] & PTE_SYSCALL;
+			if ((r = page_insert(dst, pa2page(PTE_ADDR(pt[ptx])),
+					     (void *) va, perm)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+//
+// Invalidate this CPU's TLB entry for 'va', or all its entries if va
+// is NULL, but only if the page tables being edited are the ones
+// currently in use by the processor.
+//
+void
+tlb_invalidate_local(pde_t *pgdir, void *va)
+{
+	if (curenv && curenv->env_pgdir != pgdir)
+		return;
+	if (va)
+		invlpg(va);
+	else
+		lcr3(rcr3());
+}
+
+// The CPUs other than this one that run an environment using 'pgdir'
+// (several do with sys_sfork).  A CPU that starts running one later
+// loads %cr3, which flushes its TLB.
+static uint32_t
+tlb_remote_cpus(pde_t *pgdir)
+{
+	struct Env *e;
+	uint32_t mask = 0;
+	int i;
+
+	// Our page table change must be visible before we look.
+	mfence();
+	for (i = 0; i < ncpu; i++) {
+		e = cpus[i].cpu_env;
+		if (&cpus[i] != thiscpu && e && e->env_pgdir == pgdir)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+// Have the other CPUs flush what batch 'b' asks for and wait until
+// they have, then free the pages that were waiting for it.
+static void
+tlb_batch_flush(struct TlbBatch *b)
+{
+	uint32_t me = 1 << cpunum();
+	int i;
+
+	if (b->tb_cpus) {
+		b->tb_pending = b->tb_cpus;
+		for (i = 0; i < ncpu; i++) {
+			if (b->tb_cpus & (1 << i)) {
+				atomic_or(&cpus[i].cpu_tlb_from, me);
+				lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_TLB);
+			}
+		}
+		// Some of them may be waiting for us in turn
+		while (b->tb_pending) {
+			tlb_shootdown_poll();
+			asm volatile("pause");
+		}
+	}
+	for (i = 0; i < b->tb_nfree; i++)
+		page_decref(b->tb_free[i]);
+	b->tb_pgdir = NULL;
+	b->tb_cpus = 0;
+	b->tb_nva = 0;
+	b->tb_nfree = 0;
+}
+
+// Queue a flush of 'va' in 'pgdir' (all of pgdir if va is NULL) on the
+// other CPUs that may cache it.
+static void
+tlb_queue(pde_t *pgdir, void *va)
+{
+	struct TlbBatch *b = &thiscpu->cpu_tlb;
+	uint32_t mask;
+
+	if (!(mask = tlb_remote_cpus(pgdir)))
+		return;
+	if (b->tb_pgdir != pgdir)
+		tlb_batch_flush(b);
+	b->tb_pgdir = pgdir;
+	b->tb_cpus |= mask;
+	if (!va || b->tb_nva < 0 || b->tb_nva == TLB_BATCH_MAX)
+		b->tb_nva = -1;
+	else
+		b->tb_va[b->tb_nva++] = (uintptr_t) va;
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// edited are the ones currently in use by the processor.  Other CPUs
+// running the same address space flush it too, right away or, between
+// tlb_batch_begin() and tlb_batch_end(), all at once at the end.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	struct TlbBatch *b = &thiscpu->cpu_tlb;
+
+	tlb_invalidate_local(pgdir, va);
+	tlb_queue(pgdir, va);
+	if (!b->tb_depth && b->tb_cpus)
+		tlb_batch_flush(b);
+}
+
+// Flush all of pgdir's entries on every CPU, right away.
+void
+tlb_flush(pde_t *pgdir)
+{
+	struct TlbBatch *b = &thiscpu->cpu_tlb;
+
+	tlb_invalidate_local(pgdir, NULL);
+	tlb_queue(pgdir, NULL);
+	if (b->tb_cpus)
+		tlb_batch_flush(b);
+}
+
+// Drop a mapping's reference to 'pp' once no TLB can hold the mapping
+// any more, so that no other CPU can reach the page after it is reused.
+static void
+tlb_page_release(struct PageInfo *pp)
+{
+	struct TlbBatch *b = &thiscpu->cpu_tlb;
+
+	if (!b->tb_cpus) {
+		page_decref(pp);
+		return;
+	}
+	if (b->tb_nfree == TLB_BATCH_MAX)
+		tlb_batch_flush(b);
+	b->tb_free[b->tb_nfree++] = pp;
+}
+
+// Collect the other CPUs' TLB flushes until the matching
+// tlb_batch_end(), so that unmapping many pages sends each CPU one
+// interrupt.  The caller must not give up the CPU in between.
+void
+tlb_batch_begin(void)
+{
+	thiscpu->cpu_tlb.tb_depth++;
+}
+
+void
+tlb_batch_end(void)
+{
+	struct TlbBatch *b = &thiscpu->cpu_tlb;
+
+	if (--b->tb_depth == 0 && (b->tb_cpus || b->tb_nfree))
+		tlb_batch_flush(b);
+}
+
+// Flush what other CPUs asked this one to in tlb_batch_flush.  Called
+// for the IRQ_TLB interrupt, and by CPUs spinning with interrupts off
+// (see spin_lock), so that CPUs waiting for each other cannot deadlock.
+void
+tlb_shootdown_poll(void)
+{
+	struct TlbBatch *b;
+	uint32_t from, me;
+	int i, j;
+
+	if (!thiscpu->cpu_tlb_from)
+		return;
+	from = xchg(&thiscpu->cpu_tlb_from, 0);
+	me = 1 << cpunum();
+	for (i = 0; i < ncpu; i++) {
+		if (!(from & (1 << i)))
+			continue;
+		b = &cpus[i].cpu_tlb;
+		if (PADDR(b->tb_pgdir) == rcr3()) {
+			if (b->tb_nva < 0)
+				lcr3(rcr3());
+			for (j = 0; j < b->tb_nva; j++)
+				invlpg((void *) b->tb_va[j]);
+		}
+		atomic_andnot(&b->tb_pending, me);
+	}
 }
 
 //
@@ -729,6 +1608,23 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
             return -E_FAULT;
         }
         if ((pte_ptr = pgdir_walk(env->env_pgdir, i, 0))) {
+            // Fill in a demand-zero page the kernel is about to touch
+            if ((uint32_t)i < UTOP &&
+                (*pte_ptr & (PTE_P|PTE_ZERO)) == PTE_ZERO) {
+                env_lock(env);
+                page_fault_in(env->env_pgdir, (void *)i, perm & PTE_W);
+                env_unlock(env);
+                pte_ptr = pgdir_walk(env->env_pgdir, i, 0);
+            }
+            // The kernel is about to write to a copy-on-write page on
+            // env's behalf, so give env its own copy first.
+            if ((perm & PTE_W) &&
+                ((env->env_pgdir[PDX(i)] | *pte_ptr) & PTE_COW)) {
+                env_lock(env);
+                page_cow_break(env->env_pgdir, (void *)i);
+                env_unlock(env);
+                pte_ptr = pgdir_walk(env->env_pgdir, i, 0);
+            }
             if ((*pte_ptr & (perm|PTE_P)) != (perm|PTE_P)) {
                 if (i == ROUNDDOWN(va, PGSIZE)) {
                     user_mem_check_addr = (uintptr_t)i + rounddown_offset;
@@ -941,6 +1837,9 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check the time page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timeinfo));
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
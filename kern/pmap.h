@@ -16,6 +16,7 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
+extern struct PageInfo *zero_page;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -51,17 +52,42 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+enum {
+	// In pp_flags: shared by same-page merging (kern/merge.c), so
+	// never mapped writable.
+	PP_MERGED = 1<<0,
+};
+
+// Largest run of pages page_alloc_contig can return: 2^10 pages (4MB).
+#define PAGE_MAX_ORDER	10
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_contig(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+void	page_print_stats(void);
+bool	page_zero_idle(void);
+
+void	pgtable_decref(struct PageInfo *pt);
+int	pgdir_unshare(pde_t *pgdir, const void *va);
+int	page_cow_break(pde_t *pgdir, void *va);
+int	page_reserve(pde_t *pgdir, void *va, int perm);
+int	page_fault_in(pde_t *pgdir, void *va, bool write);
+int	pgdir_copy_cow(pde_t *src, pde_t *dst);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_invalidate_local(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
+void	tlb_shootdown_poll(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
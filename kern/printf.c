@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -17,8 +19,15 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	extern const char *panicstr;
+	// Don't risk deadlocking on a lock the panicking CPU might hold.
+	bool locked = !panicstr;
 
+	if (locked)
+		cons_lock_acquire();
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locked)
+		cons_lock_release();
 	return cnt;
 }
 
@@ -1,11 +1,516 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/trap.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/ipc.h>
+#include <kern/timer.h>
+#include <kern/time.h>
+#include <kern/kclock.h>
+#include <kern/merge.h>
 
 void sched_halt(void);
+void sched_timer_arm(bool busy);
+
+// How long an environment runs before another one waiting for the same
+// CPU gets a turn.
+#define SCHED_QUANTUM_MS	10
+
+// Most free pages an idle CPU zeroes ahead of time (see page_zero_idle)
+// before it halts, which bounds how long it keeps interrupts off.
+#define SCHED_ZERO_BATCH	16
+
+// An environment that stopped running less than this long ago probably
+// still has its working set in its last CPU's cache, so idle CPUs
+// prefer to steal others.
+#define SCHED_MIGRATE_COST_US	500
+
+// Bit i is set while cpus[i] is halted in sched_halt() with nothing to
+// do.  sched_notify() uses it to choose a CPU to kick with an
+// IRQ_RESCHED interrupt when new work shows up.
+static volatile uint32_t sched_idle_cpus;
+
+#define CPU_BIT(c)	(1U << ((c) - cpus))
+
+// Number of environments that are ENV_RUNNABLE, ENV_RUNNING or
+// ENV_DYING.  Maintained by sched_set_status() so that sched_halt()
+// can tell whether the whole system is idle without scanning 'envs'.
+static volatile uint32_t sched_nactive;
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&cpus[i].cpu_rq_lock, "cpu_rq_lock");
+}
+
+// Whether e's affinity mask lets it run on CPU c.
+static bool
+sched_allowed(struct Env *e, struct CpuInfo *c)
+{
+	return (e->env_affinity & CPU_BIT(c)) != 0;
+}
+
+// Whether a should run before b.  Real-time environments go first, by
+// priority; the others by pass, so that the one that has had the least
+// CPU time for its weight goes next (stride scheduling).  Ties keep
+// FIFO order.
+static bool
+sched_before(struct Env *a, struct Env *b)
+{
+	if (a->env_prio != b->env_prio)
+		return a->env_prio > b->env_prio;
+	return a->env_prio == ENV_PRIO_NORMAL && a->env_pass < b->env_pass;
+}
+
+// Insert e into CPU c's run queue, which is kept in sched_before()
+// order.  Returns whether the queue was empty before.
+static bool
+runq_push(struct CpuInfo *c, struct Env *e)
+{
+	struct Env *prev;
+	bool first;
+
+	spin_lock(&c->cpu_rq_lock);
+	first = (c->cpu_rq_len == 0);
+	// An environment that was blocked, or ran on another CPU, must
+	// not come back with a pass far behind this CPU's and then
+	// monopolize it until it catches up.
+	if (e->env_prio == ENV_PRIO_NORMAL && e->env_pass < c->cpu_vtime)
+		e->env_pass = c->cpu_vtime;
+	for (prev = c->cpu_rq_tail; prev && sched_before(e, prev);
+	     prev = prev->env_rq_prev)
+		;
+	e->env_rq = c;
+	e->env_rq_prev = prev;
+	e->env_rq_next = prev ? prev->env_rq_next : c->cpu_rq_head;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e;
+	else
+		c->cpu_rq_tail = e;
+	if (prev)
+		prev->env_rq_next = e;
+	else
+		c->cpu_rq_head = e;
+	c->cpu_rq_len++;
+	c->cpu_timer_stale = 1;
+	spin_unlock(&c->cpu_rq_lock);
+	return first;
+}
+
+// Unlink e from CPU c's run queue.  c's run queue lock must be held.
+static void
+runq_unlink(struct CpuInfo *c, struct Env *e)
+{
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		c->cpu_rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		c->cpu_rq_tail = e->env_rq_prev;
+	c->cpu_rq_len--;
+	c->cpu_timer_stale = 1;
+	e->env_rq = NULL;
+	e->env_rq_next = e->env_rq_prev = NULL;
+}
+
+// Remove and return the head of CPU c's run queue, or NULL.
+// The returned env is still ENV_RUNNABLE; the caller must lock it and
+// check that nobody changed its status before running it.
+static struct Env *
+runq_pop(struct CpuInfo *c)
+{
+	struct Env *e;
+
+	spin_lock(&c->cpu_rq_lock);
+	if ((e = c->cpu_rq_head)) {
+		runq_unlink(c, e);
+		if (e->env_prio == ENV_PRIO_NORMAL && e->env_pass > c->cpu_vtime)
+			c->cpu_vtime = e->env_pass;
+	}
+	spin_unlock(&c->cpu_rq_lock);
+	return e;
+}
+
+// Whether e stopped running recently enough that moving it to another
+// CPU would throw away a warm cache.
+static bool
+sched_cache_hot(struct Env *e)
+{
+	if (e->env_runs == 0 || !tsc_freq)
+		return 0;
+	return read_tsc() - e->env_run_start <
+		tsc_freq * SCHED_MIGRATE_COST_US / 1000000;
+}
+
+// Remove and return an environment that this CPU may run from CPU c's
+// run queue, or NULL.  Takes the first one allowed here that is not
+// cache hot on c, else the first one allowed here.  As with runq_pop,
+// the caller must recheck the env's status.
+static struct Env *
+runq_steal(struct CpuInfo *c)
+{
+	struct Env *e, *pick = NULL;
+
+	spin_lock(&c->cpu_rq_lock);
+	for (e = c->cpu_rq_head; e; e = e->env_rq_next) {
+		if (!sched_allowed(e, thiscpu))
+			continue;
+		if (!pick)
+			pick = e;
+		if (!sched_cache_hot(e)) {
+			pick = e;
+			break;
+		}
+	}
+	if (pick)
+		runq_unlink(c, pick);
+	spin_unlock(&c->cpu_rq_lock);
+	return pick;
+}
+
+// Interrupt CPU c so that it goes through sched_yield().
+void
+sched_kick(struct CpuInfo *c)
+{
+	if (c != thiscpu)
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Called on the first interrupt after this CPU halted in sched_halt().
+void
+sched_unidle(void)
+{
+	atomic_andnot(&sched_idle_cpus, CPU_BIT(thiscpu));
+}
+
+// Make sure some CPU soon runs e, just queued on CPU c.  A halted c is
+// woken.  Otherwise an idle CPU that e may run on, if there is one, is
+// woken to steal it.
+// Failing that, a real-time e preempts a less urgent environment
+// running on c right away, and otherwise c must at least start timing
+// a quantum if its queue was empty ('first') and it is running an
+// environment with no timer armed (see sched_timer_arm).  Our own
+// curenv being put back on our queue is about to be rescheduled anyway.
+//
+// The push onto c's queue happens before we read sched_idle_cpus, and
+// sched_halt() sets a CPU's bit before checking for work, so either
+// that CPU sees the work or we see its bit.
+static void
+sched_notify(struct CpuInfo *c, struct Env *e, bool first)
+{
+	uint32_t idle = sched_idle_cpus & ~CPU_BIT(thiscpu);
+	struct Env *running = c->cpu_env;
+	int i;
+
+	if (e == curenv && c == thiscpu)
+		return;
+	if (idle & CPU_BIT(c)) {
+		sched_kick(c);
+		return;
+	}
+	idle &= e->env_affinity;
+	if (idle) {
+		for (i = 0; !(idle & (1U << i)); i++)
+			;
+		sched_kick(&cpus[i]);
+		return;
+	}
+	if (e->env_prio != ENV_PRIO_NORMAL && running &&
+	    sched_before(e, running)) {
+		if (c == thiscpu)
+			thiscpu->cpu_resched = 1;
+		else
+			sched_kick(c);
+		return;
+	}
+	if (!first)
+		return;
+	if (c == thiscpu)
+		sched_timer_arm(1);
+	else
+		sched_kick(c);
+}
+
+// Put a runnable environment on a run queue so that sched_yield can
+// find it without scanning 'envs'.  Prefer the CPU the environment last
+// ran on, so that it comes back to a warm cache; idle CPUs will steal
+// it if that CPU is busy.  Never queue it on a CPU outside its affinity
+// mask.  Does nothing if e is already queued.
+static void
+sched_enqueue(struct Env *e)
+{
+	struct CpuInfo *c = NULL;
+
+	if (e->env_rq)
+		return;
+
+	if (e->env_runs > 0 && e->env_cpunum >= 0 && e->env_cpunum < ncpu)
+		c = &cpus[e->env_cpunum];
+	if (!c || !sched_allowed(e, c))
+		c = thiscpu;
+	if (!sched_allowed(e, c))
+		for (c = cpus; c < cpus + ncpu - 1 && !sched_allowed(e, c); c++)
+			;
+	sched_notify(c, e, runq_push(c, e));
+}
+
+// Remove e from whatever run queue it is on, if any.
+static void
+sched_dequeue(struct Env *e)
+{
+	struct CpuInfo *c = e->env_rq;
+
+	if (!c)
+		return;
+	spin_lock(&c->cpu_rq_lock);
+	if (e->env_rq == c)
+		runq_unlink(c, e);
+	spin_unlock(&c->cpu_rq_lock);
+}
+
+static bool
+status_active(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING ||
+		status == ENV_DYING;
+}
+
+// Change e's status, keeping the run queues in sync: an env that
+// becomes ENV_RUNNABLE is queued, and one that leaves it is dequeued.
+// An env that is already ENV_RUNNABLE is either queued or has just been
+// popped by some CPU's sched_yield, so it is not queued a second time.
+// An env that stops being blocked no longer needs its sleep timer.
+// The caller must hold env_lock(e).
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	unsigned old = e->env_status;
+
+	if (status != ENV_NOT_RUNNABLE && e->env_timer_armed)
+		timer_cancel(e);
+	if (status != ENV_RUNNABLE)
+		sched_dequeue(e);
+	e->env_status = status;
+	if (status == ENV_RUNNABLE && old != ENV_RUNNABLE)
+		sched_enqueue(e);
+
+	if (status_active(old) && !status_active(status))
+		atomic_add(&sched_nactive, -1);
+	else if (!status_active(old) && status_active(status))
+		atomic_add(&sched_nactive, 1);
+}
+
+// Charge e for the CPU time it used since it was last charged.  Its
+// pass advances inversely to its weight, so heavier environments get
+// proportionally more turns.  The caller must hold env_lock(e).
+static void
+sched_charge(struct Env *e)
+{
+	uint64_t now = read_tsc();
+	uint64_t ran = now - e->env_run_start;
+
+	e->env_run_start = now;
+	e->env_runtime += ran;
+	e->env_pass += ran * ENV_WEIGHT_DEFAULT / e->env_weight;
+}
+
+// Make the runnable, dequeued environment e this CPU's to run.
+// The caller must hold env_lock(e).
+static void
+sched_claim(struct Env *e)
+{
+	sched_set_status(e, ENV_RUNNING);
+	e->env_cpunum = cpunum();
+	e->env_run_start = read_tsc();
+}
+
+// Called when this CPU stops running 'prev' (its curenv).  If prev is
+// still ours and running, charge it and put it back on a run queue; if
+// another CPU asked for it to be destroyed while it was here, free it.
+void
+sched_put_prev(struct Env *prev)
+{
+	env_lock(prev);
+	if (prev->env_cpunum == cpunum()) {
+		if (prev->env_status != ENV_FREE)
+			sched_charge(prev);
+		if (prev->env_status == ENV_RUNNING)
+			sched_set_status(prev, ENV_RUNNABLE);
+		else if (prev->env_status == ENV_DYING)
+			env_free(prev);
+	}
+	env_unlock(prev);
+}
+
+// Find work for this CPU when its own run queue is empty: take an
+// environment we may run from the CPU with the longest run queue,
+// trying shorter queues if none there may run here (see runq_steal).
+static struct Env *
+sched_steal(void)
+{
+	struct CpuInfo *c, *victim;
+	struct Env *e;
+	uint32_t tried = CPU_BIT(thiscpu);
+
+	while (1) {
+		victim = NULL;
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (!(tried & CPU_BIT(c)) && c->cpu_rq_len > 0 &&
+			    (!victim || c->cpu_rq_len > victim->cpu_rq_len))
+				victim = c;
+		if (!victim)
+			return NULL;
+		if ((e = runq_steal(victim)))
+			return e;
+		tried |= CPU_BIT(victim);
+	}
+}
+
+// Change e's scheduling parameters (see sys_env_set_priority).  A
+// queued env is queued again in its new place.  The caller must hold
+// env_lock(e).
+void
+sched_set_params(struct Env *e, int prio, uint32_t weight)
+{
+	struct CpuInfo *c = e->env_rq;
+
+	if (c)
+		sched_dequeue(e);
+	e->env_prio = prio;
+	e->env_weight = weight;
+	if (c)
+		sched_enqueue(e);
+}
+
+// Change the set of CPUs e may run on (see sys_env_set_affinity).  A
+// queued env on a CPU it may no longer use is queued again elsewhere,
+// and a CPU running it is made to reschedule.  The caller must hold
+// env_lock(e).
+void
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	struct CpuInfo *c;
+
+	e->env_affinity = mask;
+	if ((c = e->env_rq) && !sched_allowed(e, c)) {
+		sched_dequeue(e);
+		sched_enqueue(e);
+	} else if (e->env_status == ENV_RUNNING &&
+		   !sched_allowed(e, &cpus[e->env_cpunum])) {
+		if (e == curenv)
+			thiscpu->cpu_resched = 1;
+		else
+			sched_kick(&cpus[e->env_cpunum]);
+	}
+}
+
+// Let the normal-class environment e, which is giving up the CPU of its
+// own accord, go behind the others waiting on this CPU rather than be
+// picked again just because its pass is still the lowest.  The caller
+// must hold env_lock(e).
+void
+sched_defer(struct Env *e)
+{
+	struct Env *tail;
+
+	if (e->env_prio != ENV_PRIO_NORMAL)
+		return;
+	spin_lock(&thiscpu->cpu_rq_lock);
+	tail = thiscpu->cpu_rq_tail;
+	if (tail && tail->env_prio == ENV_PRIO_NORMAL &&
+	    e->env_pass < tail->env_pass)
+		e->env_pass = tail->env_pass;
+	spin_unlock(&thiscpu->cpu_rq_lock);
+}
+
+// Whether any CPU's run queue holds an environment this CPU could run.
+static bool
+sched_work_pending(void)
+{
+	struct CpuInfo *c;
+	struct Env *e;
+	bool found = 0;
+
+	if (thiscpu->cpu_rq_len > 0)
+		return 1;
+	for (c = cpus; c < cpus + ncpu && !found; c++) {
+		if (c == thiscpu || c->cpu_rq_len == 0)
+			continue;
+		spin_lock(&c->cpu_rq_lock);
+		for (e = c->cpu_rq_head; e && !found; e = e->env_rq_next)
+			found = sched_allowed(e, thiscpu);
+		spin_unlock(&c->cpu_rq_lock);
+	}
+	return found;
+}
+
+// Switch this CPU straight to environment 'envid' if it is runnable
+// and still waiting on a run queue, bypassing the round-robin order.
+// Used by IPC so that a sender that blocks right after waking its
+// receiver donates the rest of its timeslice to it.  Returns if the
+// env has gone away or another CPU got to it first.
+void
+sched_handoff(envid_t envid)
+{
+	struct Env *e;
+
+	if (!envid || envid2env(envid, &e, 0) < 0)
+		return;
+	env_lock(e);
+	if (e->env_id == envid && e->env_status == ENV_RUNNABLE &&
+	    e->env_rq && sched_allowed(e, thiscpu)) {
+		sched_claim(e);
+		env_unlock(e);
+		env_run(e);
+	}
+	env_unlock(e);
+}
+
+// Program this CPU's LAPIC timer as a one-shot for the next event it
+// has to handle, rather than taking a tick every 10 ms.  A CPU about to
+// run an environment ('busy') only needs to preempt it if others are
+// waiting on its run queue; work that arrives later is announced by
+// sched_notify().  The boot CPU also wakes for the earliest sleep
+// deadline (timer_arm kicks it when that changes).  A CPU with nothing
+// to do stops its timer altogether.  Without a calibrated TSC and
+// LAPIC timer the periodic tick is left alone.
+//
+// env_run only calls this on a switch, or when cpu_timer_stale says
+// the run queue or the timers changed, or the one-shot fired, since
+// the last call: returning from a system call costs no MMIO write.
+void
+sched_timer_arm(bool busy)
+{
+	uint64_t usec = 0, now, wait;
+	uint32_t deadline, now_ms;
+
+	thiscpu->cpu_timer_stale = 0;
+	if (!tsc_freq || !lapic_timer_freq)
+		return;
+	if (busy && thiscpu->cpu_rq_len > 0)
+		usec = SCHED_QUANTUM_MS * 1000;
+	if (thiscpu == bootcpu && timer_next(&deadline)) {
+		now = time_usec();
+		now_ms = now / 1000;
+		if (msec_before(now_ms, deadline))
+			wait = (uint64_t) (deadline - now_ms) * 1000 - now % 1000;
+		else
+			wait = 1;
+		if (usec == 0 || wait < usec)
+			usec = wait;
+	}
+	if (usec)
+		lapic_timer_oneshot(usec);
+	else
+		lapic_timer_stop();
+}
 
 // Choose a user environment to run and run it.
 void
@@ -13,90 +518,104 @@ sched_yield(void)
 {
 	struct Env *idle;
 
-	// Implement simple round-robin scheduling.
+	// Senders whose receiver died can only be woken from here, where
+	// no locks are held.
+	ipc_wake_orphans();
+
+	// Charge the environment this CPU was running and put it back on
+	// our run queue, so that it competes with the others below.  Once
+	// it is queued, another CPU may destroy it and free its page
+	// directory, so stop using that first.
+	thiscpu->cpu_resched = 0;
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    curenv->env_cpunum == cpunum()) {
+		lcr3(PADDR(kern_pgdir));
+		sched_put_prev(curenv);
+	}
+
+	// Run the head of this CPU's run queue, which is kept in priority
+	// and pass order (see sched_before), at a cost that depends only
+	// on the number of runnable environments.
 	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// If our queue is empty, steal from the busiest CPU.  Environments
+	// running on other CPUs are never queued, so they are never chosen
+	// here.
 	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
+	// An env popped from a queue may have been blocked, destroyed or
+	// even reallocated by another CPU before we lock it, so only run
+	// it if it is still runnable and nobody has queued it again.  If
+	// its affinity changed meanwhile, queue it where it may run.
 	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-    uint32_t i;
-    uint32_t cur_envx;
-
-    if (curenv) {
-        cur_envx = ENVX(curenv->env_id);
-    }
-    else {
-        cur_envx = 0;
-    }
-    idle = 0;
-    for (i = 0; i < NENV; i++) {
-        if (envs[(cur_envx + i) % NENV].env_status != ENV_RUNNABLE) {
-            continue;
-        }
-        //cprintf("cpu: %d, %d\n", thiscpu->cpu_id, envs[i].env_status);
-        idle = &envs[(cur_envx + i) % NENV];
-        //cprintf("find from runnable, work cpu:%d, env:%x, status:%d\n", thiscpu->cpu_id, idle->env_id, idle->env_status);
-        env_run(idle);
-    }
-    for (i = 0; i < NENV; i++) {
-      if (envs[(cur_envx + i) % NENV].env_status == ENV_RUNNING ) {
-          if (envs[(cur_envx + i) % NENV].env_cpunum == thiscpu->cpu_id) {
-              idle = &envs[(cur_envx + i) % NENV];
-              //cprintf("find from running, running on cpu %d, work cpu:%d, env:%x, status:%d\n", idle->env_cpunum, thiscpu->cpu_id, idle->env_id, idle->env_status);
-              env_run(idle);
-          }
-      }
-    }
-
-    //cprintf("%d: no env to run\n", thiscpu->cpu_id);
-	// sched_halt never returns
-	sched_halt();
+	// sched_halt returns if work showed up while it got ready to
+	// halt; look again from here rather than growing the stack.
+	for (;;) {
+		while ((idle = runq_pop(thiscpu)) || (idle = sched_steal())) {
+			env_lock(idle);
+			if (idle->env_status == ENV_RUNNABLE && !idle->env_rq) {
+				if (!sched_allowed(idle, thiscpu)) {
+					sched_enqueue(idle);
+					env_unlock(idle);
+					continue;
+				}
+				sched_claim(idle);
+				env_unlock(idle);
+				env_run(idle);
+			}
+			env_unlock(idle);
+		}
+		sched_halt();
+	}
 }
 
 // Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// timer interrupt wakes it up. This function returns only if work
+// shows up before the CPU halts, for sched_yield to pick it up.
 //
 void
 sched_halt(void)
 {
 	int i;
 
-    //cprintf("enter halt\n");
+	// Mark that no environment is running on this CPU, switching off
+	// its page directory first as sched_yield does
+	lcr3(PADDR(kern_pgdir));
+	if (curenv)
+		sched_put_prev(curenv);
+	curenv = NULL;
+
 	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
+	// environments in the system, and none sleeping until a deadline,
+	// then drop into the kernel monitor.
+	if (sched_nactive == 0 && timer_npending() == 0) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	// Put the idle time to use clearing free pages for page_alloc, as
+	// long as no work shows up for us.
+	for (i = 0; i < SCHED_ZERO_BATCH && !sched_work_pending() &&
+		    page_zero_idle(); i++)
+		;
+	// Then on same-page merging, if it is on: one page table per halt.
+	if (!sched_work_pending())
+		merge_idle();
+
+	// Sleep until the next event this CPU must handle, if any
+	sched_timer_arm(0);
 
 	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// timer interupts come in, trap() knows we were idle
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Advertise that we are idle, then look for work once more: an
+	// environment queued before our bit was visible did not kick us.
+	atomic_or(&sched_idle_cpus, CPU_BIT(thiscpu));
+	if (sched_work_pending()) {
+		xchg(&thiscpu->cpu_status, CPU_STARTED);
+		sched_unidle();
+		return;
+	}
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -110,4 +629,3 @@ sched_halt(void)
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
-
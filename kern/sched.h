@@ -9,4 +9,21 @@
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_init(void);
+
+// Run queue maintenance.  Every ENV_RUNNABLE environment sits on
+// exactly one CPU's run queue; all env_status changes of live envs go
+// through sched_set_status() with the env locked.
+struct Env;
+void sched_set_status(struct Env *e, unsigned status);
+void sched_put_prev(struct Env *prev);
+void sched_handoff(envid_t envid);
+void sched_timer_arm(bool busy);
+void sched_set_params(struct Env *e, int prio, uint32_t weight);
+void sched_set_affinity(struct Env *e, uint32_t mask);
+void sched_defer(struct Env *e);
+struct CpuInfo;
+void sched_kick(struct CpuInfo *c);
+void sched_unidle(void);
+
 #endif	// !JOS_KERN_SCHED_H
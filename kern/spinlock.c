@@ -9,13 +9,7 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 #include <kern/env.h>
-
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+#include <kern/pmap.h>
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -72,8 +66,12 @@ spin_lock(struct spinlock *lk)
     //if (curenv){
     //    cprintf("acq lock,id:%x, cpu:%d\n", curenv->env_id, curenv->env_cpunum);
     //}
-	while (xchg(&lk->locked, 1) != 0)
+	// Interrupts are off in the kernel, so answer TLB shootdowns
+	// while we wait: the holder may be waiting for us to.
+	while (xchg(&lk->locked, 1) != 0) {
+		tlb_shootdown_poll();
 		asm volatile ("pause");
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
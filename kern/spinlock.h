@@ -25,24 +25,22 @@ void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// There is no big kernel lock.  Each subsystem protects its own state:
+//
+//   merge_lock         same-page merging scanner (kern/merge.c)
+//   env_lock(e)        per-Env state: status, IPC fields, page tables
+//                      (kern/env.c)
+//   ipc_sendq_lock     IPC sender queues (kern/ipc.c)
+//   timer_lock         heap of armed sleep timers (kern/timer.c)
+//   env_table_lock     env_free_list and env id generation (kern/env.c)
+//   cpu_rq_lock        a CPU's run queue (kern/sched.c)
+//   pc_lock            a CPU's cache of free pages (kern/pmap.c)
+//   page_zero_lock     pool of pre-zeroed pages (kern/pmap.c)
+//   page_lock          page_free_list and the buddy lists (kern/pmap.c)
+//   cons_lock          console input buffer and output (kern/console.c)
+//
+// Locks must be acquired in that order, top to bottom.  When two Envs
+// must be locked at once, use env_lock_pair(), which orders them by
+// address.  Never hold a lock across sched_yield() or env_run().
 
 #endif
@@ -12,7 +12,18 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/timer.h>
 #include <kern/e1000.h>
+#include <kern/ipc.h>
+
+// envid2env() looks an env up without locking it, so by the time the
+// caller holds env_lock(e) the env may have been freed or reused.
+// Returns true if e still is the env that 'envid' named.
+static bool
+env_still_valid(struct Env *e, envid_t envid)
+{
+	return e->env_status != ENV_FREE && (envid == 0 || e->env_id == envid);
+}
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -47,6 +58,7 @@ sys_getenvid(void)
 }
 
 // Destroy a given environment (possibly the currently running environment).
+// Destroying an environment that is already being destroyed succeeds.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -59,7 +71,12 @@ sys_env_destroy(envid_t envid)
 
 	if ((r = envid2env(envid, &e, 1)) < 0)
 		return r;
-	env_destroy(e);
+	env_lock(e);
+	if (!env_still_valid(e, envid)) {
+		env_unlock(e);
+		return -E_BAD_ENV;
+	}
+	env_destroy_locked(e);
 	return 0;
 }
 
@@ -67,6 +84,9 @@ sys_env_destroy(envid_t envid)
 static void
 sys_yield(void)
 {
+	env_lock(curenv);
+	sched_defer(curenv);
+	env_unlock(curenv);
 	sched_yield();
 }
 
@@ -93,10 +113,15 @@ sys_exofork(void)
     int r;
     r = env_alloc(&new_user_env, curenv->env_id);
     if (r == 0) {
-        new_user_env->env_status = ENV_NOT_RUNNABLE;
+        // env_alloc leaves the new env ENV_NOT_RUNNABLE
         envid2env(new_user_env->env_parent_id, &parent_env, 1);
         new_user_env->env_tf         = parent_env->env_tf;
         new_user_env->env_tf.tf_regs.reg_eax = 0;
+        // Children share the CPU like their parent and stay on the
+        // same CPUs, but do not inherit the real-time class.
+        new_user_env->env_weight     = parent_env->env_weight;
+        new_user_env->env_affinity   = parent_env->env_affinity;
+        new_user_env->env_uxstacktop = parent_env->env_uxstacktop;
         return new_user_env->env_id;
     }
     else {
@@ -104,6 +129,202 @@ sys_exofork(void)
     }
 }
 
+// Fork the current environment in one system call.  The child gets a
+// copy-on-write view of the parent's address space below UTOP (pages
+// marked PTE_SHARE stay shared), a fresh exception stack if the parent
+// has one, the parent's page fault upcall, and starts out runnable.
+// Write faults on the copy-on-write pages are resolved by the kernel.
+//
+// Returns the child's envid to the parent and 0 to the child, or
+// < 0 on error:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    struct Env *child;
+    struct PageInfo *pp;
+    envid_t envid;
+    int r;
+
+    if ((envid = sys_exofork()) < 0)
+        return envid;
+    if ((r = envid2env(envid, &child, 1)) < 0)
+        return r;
+
+    env_lock_pair(curenv, child);
+    if ((r = pgdir_copy_cow(curenv->env_pgdir, child->env_pgdir)) < 0)
+        goto fail;
+    if (page_lookup(curenv->env_pgdir, (void *)(UXSTACKTOP - PGSIZE), NULL)) {
+        if (!(pp = page_alloc(ALLOC_ZERO))) {
+            r = -E_NO_MEM;
+            goto fail;
+        }
+        if ((r = page_insert(child->env_pgdir, pp, (void *)(UXSTACKTOP - PGSIZE),
+                             PTE_U | PTE_W | PTE_P)) < 0) {
+            page_free(pp);
+            goto fail;
+        }
+    }
+    // Our writable pages just turned read-only
+    tlb_flush(curenv->env_pgdir);
+    child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    sched_set_status(child, ENV_RUNNABLE);
+    env_unlock_pair(curenv, child);
+    return envid;
+
+fail:
+    // Pages already made copy-on-write in the parent just cost it a
+    // page fault and a copy later.
+    tlb_flush(curenv->env_pgdir);
+    env_unlock_pair(curenv, child);
+    env_destroy(child);
+    return r;
+}
+
+// Create a thread: a new environment sharing the current one's address
+// space, page fault upcall and scheduling parameters, which starts out
+// runnable.  It returns 0 from this call on its own stack: the page
+// holding the caller's stack is copied to the page at 'stack', and its
+// %esp and %ebp are moved to match; the frame pointers saved in that
+// copy are left for it to fix.  It takes page faults on the exception
+// stack ending at 'xstacktop'.
+//
+// Returns the new envid to the caller, or < 0 on error:
+//	-E_INVAL if stack is not a page-aligned address below UTOP
+//		mapped writable, or xstacktop is not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_sfork(void *stack, uintptr_t xstacktop)
+{
+    struct Env *child;
+    struct PageInfo *src, *dst;
+    pte_t *pte;
+    uintptr_t base;
+    envid_t envid;
+    int r;
+
+    if ((uintptr_t)stack % PGSIZE || (uintptr_t)stack >= UTOP ||
+        xstacktop % PGSIZE || xstacktop > UTOP) {
+        return -E_INVAL;
+    }
+    if ((envid = sys_exofork()) < 0)
+        return envid;
+    if ((r = envid2env(envid, &child, 1)) < 0)
+        return r;
+    env_share_vm(child, curenv);
+
+    // This also locks child, and keeps our other threads from
+    // changing the mappings while we copy.
+    env_lock(curenv);
+    base = ROUNDDOWN(curenv->env_tf.tf_esp, PGSIZE);
+    if ((r = page_cow_break(curenv->env_pgdir, stack)) < 0)
+        goto fail;
+    src = page_lookup(curenv->env_pgdir, (void *)base, NULL);
+    dst = page_lookup(curenv->env_pgdir, stack, &pte);
+    if (!src || !dst || (*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W)) {
+        r = -E_INVAL;
+        goto fail;
+    }
+    memmove(page2kva(dst), page2kva(src), PGSIZE);
+
+    child->env_tf.tf_esp += (uintptr_t)stack - base;
+    if (ROUNDDOWN(child->env_tf.tf_regs.reg_ebp, PGSIZE) == base)
+        child->env_tf.tf_regs.reg_ebp += (uintptr_t)stack - base;
+    child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    child->env_uxstacktop = xstacktop;
+    sched_set_status(child, ENV_RUNNABLE);
+    env_unlock(curenv);
+    return envid;
+
+fail:
+    env_unlock(curenv);
+    env_destroy(child);
+    return r;
+}
+
+// Set envid's scheduling parameters.  If 'prio' is ENV_PRIO_NORMAL, the
+// environment shares the CPU with the other normal ones in proportion to
+// 'weight', from 1 to ENV_WEIGHT_MAX (ENV_WEIGHT_DEFAULT by default).
+// A 'prio' from 1 to ENV_PRIO_RT_MAX puts it in the real-time class:
+// it runs before every normal environment and every lower real-time
+// priority, and 'weight' is ignored.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio or weight is out of range.
+static int
+sys_env_set_priority(envid_t envid, int prio, uint32_t weight)
+{
+    struct Env *e;
+    int r;
+
+    if (prio < ENV_PRIO_NORMAL || prio > ENV_PRIO_RT_MAX) {
+        return -E_INVAL;
+    }
+    if (prio == ENV_PRIO_NORMAL && (weight < 1 || weight > ENV_WEIGHT_MAX)) {
+        return -E_INVAL;
+    }
+    if (prio != ENV_PRIO_NORMAL) {
+        weight = ENV_WEIGHT_DEFAULT;
+    }
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+    env_lock(e);
+    if (!env_still_valid(e, envid)) {
+        env_unlock(e);
+        return -E_BAD_ENV;
+    }
+    sched_set_params(e, prio, weight);
+    env_unlock(e);
+    return 0;
+}
+
+// Restrict envid to the CPUs in 'cpumask': bit i allows it to run on
+// CPU i.  Bits for CPUs that do not exist are ignored.  An environment
+// that is running or queued on a CPU it may no longer use moves to one
+// it may.  Children created with sys_exofork inherit the mask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask allows none of the CPUs.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+    struct Env *e;
+    int r;
+
+    if (ncpu < 32) {
+        cpumask &= (1U << ncpu) - 1;
+    }
+    if (cpumask == 0) {
+        return -E_INVAL;
+    }
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+    env_lock(e);
+    if (!env_still_valid(e, envid)) {
+        env_unlock(e);
+        return -E_BAD_ENV;
+    }
+    sched_set_affinity(e, cpumask);
+    env_unlock(e);
+    return 0;
+}
+
+// Return the number of CPUs, so that bit ncpu - 1 is the highest
+// affinity mask bit sys_env_set_affinity honours.
+static int
+sys_ncpu(void)
+{
+    return ncpu;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -132,7 +353,19 @@ sys_env_set_status(envid_t envid, int status)
     r = envid2env(envid, &this_env, 1);
     //cprintf("r:%d\n",r);
     if (r == 0) {
-        this_env->env_status = status;
+        env_lock(this_env);
+        if (!env_still_valid(this_env, envid)) {
+            env_unlock(this_env);
+            return -E_BAD_ENV;
+        }
+        // An env running on some CPU is neither queued nor blocked;
+        // it stays where it is until it next traps into the kernel.
+        // A dying env is left for trap() to reap.
+        if (this_env->env_status != ENV_DYING &&
+            (status == ENV_NOT_RUNNABLE || this_env->env_status != ENV_RUNNING)) {
+            sched_set_status(this_env, status);
+        }
+        env_unlock(this_env);
         return r;
     }
     else {
@@ -160,9 +393,16 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
     
     r = envid2env(envid, &thisenv, 1);
     if (r == 0) {
-        thisenv->env_tf = *tf;
-        thisenv->env_tf.tf_cs     |= 3;
-        thisenv->env_tf.tf_eflags |= FL_IF;
+        env_lock(thisenv);
+        if (env_still_valid(thisenv, envid)) {
+            thisenv->env_tf = *tf;
+            thisenv->env_tf.tf_cs     |= 3;
+            thisenv->env_tf.tf_eflags |= FL_IF;
+        }
+        else {
+            r = -E_BAD_ENV;
+        }
+        env_unlock(thisenv);
 
         return r;
     }
@@ -205,6 +445,11 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
 //
+// If 'flags' has SYS_PAGE_NOZERO, the caller promises to overwrite the
+// whole page, so it need not be cleared.  Only environments with I/O
+// privilege, which can read any memory through devices anyway, get
+// such a page; the others could see another environment's old data.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
@@ -213,7 +458,7 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
-sys_page_alloc(envid_t envid, void *va, int perm)
+sys_page_alloc(envid_t envid, void *va, int perm, int flags)
 {
 	// Hint: This function is a wrapper around page_alloc() and
 	//   page_insert() from kern/pmap.c.
@@ -239,10 +484,27 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     }
     r = envid2env(envid, &this_env, 1);
     if (r == 0) {
-        new_page = page_alloc(ALLOC_ZERO);
+        if ((flags & SYS_PAGE_NOZERO) &&
+            (curenv->env_tf.tf_eflags & FL_IOPL_MASK)) {
+            new_page = page_alloc(0);
+        }
+        else {
+            new_page = page_alloc(ALLOC_ZERO);
+        }
         if (new_page != NULL) {
             //cprintf("[sys_page_alloc]3env id:%x, va:%x, thisenv content:%x, new page:%x, ref:%x\n", curenv->env_id, va, *(uint32_t*)0x804004, new_page, new_page->pp_ref);
-            return page_insert(this_env->env_pgdir, new_page, va, perm);
+            env_lock(this_env);
+            if (env_still_valid(this_env, envid)) {
+                r = page_insert(this_env->env_pgdir, new_page, va, perm);
+            }
+            else {
+                r = -E_BAD_ENV;
+            }
+            env_unlock(this_env);
+            if (r < 0) {
+                page_free(new_page);
+            }
+            return r;
         }
         else {
             return -E_NO_MEM;
@@ -253,6 +515,187 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     }
 }
 
+// Copy 'len' bytes at 'src' to 'va' in e's address space.  The copy
+// goes through e's page tables under env_lock(e), so another thread
+// of e unmapping 'va' meanwhile cannot make the kernel fault.
+// Returns 0, or -E_FAULT if e cannot write all of [va, va+len).
+static int
+user_copy_out(struct Env *e, void *va, const void *src, size_t len)
+{
+    struct PageInfo * pp;
+    pte_t * pte;
+    uintptr_t uva;
+    size_t off, n;
+    int r = 0;
+
+    // Fills in demand-zero pages and breaks copy-on-write ones
+    if (user_mem_check(e, va, len, PTE_U | PTE_W) < 0) {
+        return -E_FAULT;
+    }
+    env_lock(e);
+    for (off = 0; off < len; off += n) {
+        uva = (uintptr_t)va + off;
+        n   = MIN(len - off, PGSIZE - PGOFF(uva));
+        if (!(pp = page_lookup(e->env_pgdir, (void*)uva, &pte)) ||
+            (*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W) ||
+            !(e->env_pgdir[PDX(uva)] & PTE_W)) {
+            r = -E_FAULT;
+            break;
+        }
+        memmove((char*)page2kva(pp) + PGOFF(uva), (const char*)src + off, n);
+    }
+    env_unlock(e);
+    return r;
+}
+
+// Allocate 2^order physically contiguous pages and map them at 'va' in
+// the address space of 'envid', with permission 'perm' as for
+// sys_page_alloc, for device DMA.  The pages' contents are set to 0.
+// If 'pa_store' is not null, store the physical address of the first
+// page in *pa_store.  Pages already mapped in the range are unmapped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range reaches UTOP.
+//	-E_INVAL if perm is inappropriate, or order > PAGE_MAX_ORDER.
+//	-E_NO_MEM if there is no free run of pages that large,
+//		or no memory to allocate any necessary page tables.
+//	-E_FAULT if pa_store stopped being writable, for example because
+//		the new mappings replaced it; the pages stay mapped.
+static int
+sys_page_alloc_contig(envid_t envid, void *va, int perm, unsigned order,
+                      physaddr_t *pa_store)
+{
+    struct Env *e;
+    struct PageInfo *pp;
+    physaddr_t pa;
+    uint32_t i, j, n;
+    int r;
+
+    if (order > PAGE_MAX_ORDER) {
+        return -E_INVAL;
+    }
+    n = 1 << order;
+    if ((uint32_t) va % PGSIZE || (uint32_t) va >= UTOP ||
+        UTOP - (uint32_t) va < n * PGSIZE ||
+        (perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P) ||
+        (perm | PTE_SYSCALL) != PTE_SYSCALL) {
+        return -E_INVAL;
+    }
+    if (pa_store) {
+        user_mem_assert(curenv, pa_store, sizeof(*pa_store), PTE_U | PTE_W);
+    }
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+    if (!(pp = page_alloc_contig(order, ALLOC_ZERO))) {
+        return -E_NO_MEM;
+    }
+
+    env_lock(e);
+    r = env_still_valid(e, envid) ? 0 : -E_BAD_ENV;
+    for (i = 0; r == 0 && i < n; i++) {
+        if ((r = page_insert(e->env_pgdir, &pp[i], va + i * PGSIZE,
+                             perm)) < 0) {
+            // Undo the mappings made so far; that frees their pages.
+            tlb_batch_begin();
+            for (j = 0; j < i; j++) {
+                page_remove(e->env_pgdir, va + j * PGSIZE);
+            }
+            tlb_batch_end();
+            break;
+        }
+    }
+    env_unlock(e);
+    if (r < 0) {
+        // Free the pages that never got mapped: pp[i] on.
+        for (; i < n; i++) {
+            page_free(&pp[i]);
+        }
+        return r;
+    }
+    if (pa_store) {
+        // The new mappings, or another thread, may have changed what
+        // is at pa_store since it was checked.
+        pa = page2pa(pp);
+        return user_copy_out(curenv, pa_store, &pa, sizeof(pa));
+    }
+    return 0;
+}
+
+// Reserve the pages covering [va, va+len) in the address space of
+// 'envid' as demand-zero, with permission 'perm' as for sys_page_alloc.
+// No memory is allocated for them yet: the first access to each page,
+// by the environment or by the kernel on its behalf, maps a fresh
+// zero-filled page there.  Pages already mapped in the range are
+// unmapped.  sys_page_unmap drops a reservation.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range reaches UTOP.
+//	-E_INVAL if perm is inappropriate.
+//	-E_NO_MEM if there's no memory to allocate the page tables; the
+//		range may then be partly reserved.
+static int
+sys_vm_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+    struct Env *e;
+    uint32_t i;
+    int r;
+
+    len = ROUNDUP(len, PGSIZE);
+    if ((uint32_t) va % PGSIZE || (uint32_t) va >= UTOP ||
+        UTOP - (uint32_t) va < len ||
+        (perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P) ||
+        (perm | PTE_SYSCALL) != PTE_SYSCALL) {
+        return -E_INVAL;
+    }
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+
+    env_lock(e);
+    r = env_still_valid(e, envid) ? 0 : -E_BAD_ENV;
+    tlb_batch_begin();
+    for (i = 0; r == 0 && i < len; i += PGSIZE) {
+        r = page_reserve(e->env_pgdir, va + i, perm);
+    }
+    tlb_batch_end();
+    env_unlock(e);
+    return r;
+}
+
+// The body of sys_page_map once both environments are locked, also
+// used by sys_ipc_try_send, which already holds both locks.
+static int
+page_map_locked(struct Env *src_env, void *srcva,
+		struct Env *dst_env, void *dstva, int perm)
+{
+    pte_t * src_pte_ptr;
+    struct PageInfo * src_page;
+
+    // Sharing a demand-zero page shares the page it is filled with.
+    // A copy-on-write page, or one in a shared page table, may only
+    // look read-only: break that before sharing it writable.
+    if (page_fault_in(src_env->env_pgdir, srcva, perm & PTE_W) < 0 ||
+        ((perm & PTE_W) && page_cow_break(src_env->env_pgdir, srcva) < 0)) {
+        return -E_NO_MEM;
+    }
+    if ((src_page = page_lookup(src_env->env_pgdir, srcva, &src_pte_ptr))) {
+        if ((perm & PTE_W) && !(PGOFF(*src_pte_ptr) & PTE_W)) {
+            return -E_INVAL;
+        }
+        //cprintf("[sys_page_map]dstva:%x, srccontent:%x, perm:%x\n", dstva, *src_pte_ptr, perm);
+        return page_insert(dst_env->env_pgdir, src_page, dstva, perm);
+    }
+    else {
+        //cprintf("2\n");
+        return -E_INVAL;
+    }
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -304,17 +747,16 @@ sys_page_map(envid_t srcenvid, void *srcva,
     r_dst = envid2env(dstenvid, &dst_env, 0);
     //cprintf("r_src:%d, destid,:%x, r_dst:%d, return:%d\n", r_src, dstenvid, r_dst, r_src|r_dst);
     if ((r_src == 0) && (r_dst == 0)) {
-        if ((src_page = page_lookup(src_env->env_pgdir, srcva, &src_pte_ptr))) {
-            if ((perm & PTE_W) && !(PGOFF(*src_pte_ptr) & PTE_W)) {
-                return -E_INVAL;
-            }
-            //cprintf("[sys_page_map]dstva:%x, srccontent:%x, perm:%x\n", dstva, *src_pte_ptr, perm);
-            return page_insert(dst_env->env_pgdir, src_page, dstva, perm);
+        env_lock_pair(src_env, dst_env);
+        if (env_still_valid(src_env, srcenvid) &&
+            env_still_valid(dst_env, dstenvid)) {
+            r_src = page_map_locked(src_env, srcva, dst_env, dstva, perm);
         }
         else {
-            //cprintf("2\n");
-            return -E_INVAL;
+            r_src = -E_BAD_ENV;
         }
+        env_unlock_pair(src_env, dst_env);
+        return r_src;
     }
     else {
         //cprintf("3\n");
@@ -329,6 +771,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if there's no memory to split a page table shared
+//		with another environment since sys_fork.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -346,14 +790,137 @@ sys_page_unmap(envid_t envid, void *va)
     r = envid2env(envid, &this_env, 1);
     if (r == 0) {
         //cprintf("[sys_page_umap]va:%x\n", va);
-        page_remove(this_env->env_pgdir, va);
-        return 0;
+        env_lock(this_env);
+        if (!env_still_valid(this_env, envid)) {
+            r = -E_BAD_ENV;
+        }
+        else if ((r = pgdir_unshare(this_env->env_pgdir, va)) >= 0) {
+            page_remove(this_env->env_pgdir, va);
+            r = 0;
+        }
+        env_unlock(this_env);
+        return r;
     }
     else {
         return r;
     }
 }
 
+// Check the 'srcva' and 'perm' arguments of a send from 'src', as
+// described for sys_ipc_try_send, and its 'msglen'-byte message at
+// 'msg'.  The caller must hold env_lock(src).
+static int
+ipc_check_send(struct Env *src, void *srcva, unsigned perm,
+	       const void *msg, size_t msglen)
+{
+    pte_t * src_pte_ptr;
+    uintptr_t va;
+
+    if (msglen > IPC_MSG_MAX) {
+        return -E_INVAL;
+    }
+    // We hold src's lock, which user_mem_check would take to fill in
+    // demand-zero pages, so fill them in here.
+    for (va = ROUNDDOWN((uintptr_t) msg, PGSIZE);
+         va < (uintptr_t) msg + msglen && va < UTOP; va += PGSIZE) {
+        if (page_fault_in(src->env_pgdir, (void *) va, 0) < 0) {
+            return -E_NO_MEM;
+        }
+    }
+    if (msglen && user_mem_check(src, msg, msglen, PTE_U) < 0) {
+        return -E_INVAL;
+    }
+    if ((uint32_t)srcva >= UTOP) {
+        return 0;
+    }
+    // As in page_map_locked
+    if ((perm & PTE_W) && (uint32_t)srcva % PGSIZE == 0 &&
+        (page_fault_in(src->env_pgdir, srcva, 1) < 0 ||
+         page_cow_break(src->env_pgdir, srcva) < 0)) {
+        return -E_NO_MEM;
+    }
+    src_pte_ptr = pgdir_walk(src->env_pgdir, srcva, 0);
+
+    bool perm_check =  (((perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P)) ||
+                       //(perm != (PTE_U|PTE_P|PTE_AVAIL)) &&
+                       //(perm != (PTE_U|PTE_P|PTE_W)) && 
+                       ((perm | PTE_SYSCALL) != PTE_SYSCALL));
+    //check srcva
+    if (((uint32_t)srcva % PGSIZE) ||
+        perm_check ||
+        (src_pte_ptr == NULL) ||
+        (((perm) & PTE_W) && ((PGOFF(*src_pte_ptr) & PTE_W) != PTE_W))) {
+        return -E_INVAL;
+    }
+    return 0;
+}
+
+// Copy 'len' bytes at 'msg' in src's address space into dst's
+// env_ipc_msg.  src need not be curenv, so go through src's page
+// tables rather than the current ones.
+static int
+ipc_copy_msg(struct Env *src, struct Env *dst, const void *msg, size_t len)
+{
+    struct PageInfo * pp;
+    uintptr_t va;
+    size_t off, n;
+
+    for (off = 0; off < len; off += n) {
+        va = (uintptr_t)msg + off;
+        n  = MIN(len - off, PGSIZE - PGOFF(va));
+        if (!(pp = page_lookup(src->env_pgdir, (void*)va, NULL))) {
+            return -E_INVAL;
+        }
+        memmove(dst->env_ipc_msg + off, (char*)page2kva(pp) + PGOFF(va), n);
+    }
+    dst->env_ipc_msglen = len;
+    return 0;
+}
+
+// Deliver a message from 'src' to 'dst', which is blocked in
+// sys_ipc_recv, mapping the page at 'srcva' if both sides want one and
+// copying the 'msglen'-byte message at 'msg' into dst's env_ipc_msg.
+// Does not wake dst.  The caller must hold both env locks.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm, const void *msg, size_t msglen)
+{
+    int r;
+
+    if ((r = ipc_copy_msg(src, dst, msg, msglen)) < 0) {
+        return r;
+    }
+    if ((srcva < (void*)UTOP) && (dst->env_ipc_dstva < (void*)UTOP)) {
+        r = page_map_locked(src, srcva, dst, dst->env_ipc_dstva, perm);
+        if (r < 0) {
+            return r;
+        }
+        //cprintf("map, src:%x, destva: %x, content:%x,r:%d\n", srcva,dst->env_ipc_dstva, (*(uint32_t*)dst->env_ipc_dstva),r);
+        dst->env_ipc_perm    = perm;
+    }
+    else {
+        dst->env_ipc_perm    = 0;
+    }
+    dst->env_ipc_recving = 0;
+    dst->env_ipc_recv_from = 0;
+    dst->env_ipc_from    = src->env_id;
+    dst->env_ipc_value   = value;
+    return 0;
+}
+
+// Whether 'dst' takes a message from 'src' now: it is blocked
+// receiving, and if it is waiting for the reply to a sys_ipc_call, the
+// message comes from the env it called.  A receiver open to anyone has
+// found its sender queue empty (see sys_ipc_recv), and others queue up
+// behind it, so delivering straight to it keeps queued senders first.
+static bool
+ipc_recving_from(struct Env *dst, struct Env *src)
+{
+    return dst->env_ipc_recving &&
+           (dst->env_ipc_recv_from == 0 ||
+            dst->env_ipc_recv_from == src->env_id);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -382,7 +949,8 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//		or another environment managed to send first, or envid
+//		is waiting for the reply to a call to another env.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -392,66 +960,175 @@ sys_page_unmap(envid_t envid, void *va)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//
+// ipc_try_send also copies the 'msglen'-byte message at 'msg' into the
+// target's env_ipc_msg, setting env_ipc_msglen; sys_ipc_try_send sends
+// an empty one.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     const void *msg, size_t msglen)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_try_send not implemented");
     
     struct Env * tgt_env;
     int r;
-    pte_t * src_pte_ptr;
-    pte_t * tgt_pte_ptr;
 
     if ((r = envid2env(envid, &tgt_env, 0)) != 0) {
-        panic("%e id:%x", r, envid);
+        return r;
+    }
+    env_lock_pair(curenv, tgt_env);
+    if (!env_still_valid(tgt_env, envid)) {
+        r = -E_BAD_ENV;
+        goto out;
+    }
+    if ((r = ipc_check_send(curenv, srcva, perm, msg, msglen)) < 0) {
+        goto out;
     }
-    src_pte_ptr = pgdir_walk(curenv->env_pgdir, srcva, 0);
-    tgt_pte_ptr = pgdir_walk(tgt_env->env_pgdir, tgt_env->env_ipc_dstva, 1);
 
-    bool perm_check =  (((perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P)) ||
-                       //(perm != (PTE_U|PTE_P|PTE_AVAIL)) &&
-                       //(perm != (PTE_U|PTE_P|PTE_W)) && 
-                       ((perm | PTE_SYSCALL) != PTE_SYSCALL));
-    //check srcva
-    if ((((uint32_t)srcva < UTOP) && ((uint32_t)srcva % PGSIZE)) ||
-        (((uint32_t)srcva < UTOP) && perm_check) ||
-        (((uint32_t)srcva < UTOP) && (src_pte_ptr == NULL)) ||
-        (((uint32_t)srcva < UTOP) && ((perm) & PTE_W) && ((PGOFF(*src_pte_ptr) & PTE_W) != PTE_W))) {
-        return -E_INVAL;
+    //cprintf("[try_send]2\n");
+    if (!ipc_recving_from(tgt_env, curenv)) {
+        r = -E_IPC_NOT_RECV;
+        goto out;
+    }
+    if ((r = ipc_deliver(curenv, tgt_env, value, srcva, perm,
+                         msg, msglen)) < 0) {
+        goto out;
     }
+    tgt_env->env_tf.tf_regs.reg_eax = 0;
+    sched_set_status(tgt_env, ENV_RUNNABLE);
+    curenv->env_ipc_handoff = tgt_env->env_id;
+    //cprintf("\n[sys_ipc_try_send]cpu:%d, %x send successfully, set %x runnable, set return value eax:%x\n",curenv->env_cpunum, curenv->env_id, tgt_env->env_id, tgt_env->env_tf.tf_regs.reg_eax);
 
-    if (tgt_pte_ptr == NULL) {
-        return -E_NO_MEM;
+out:
+    env_unlock_pair(curenv, tgt_env);
+    return r;
+}
+
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    return ipc_try_send(envid, value, srcva, perm, NULL, 0);
+}
+
+// The common body of sys_ipc_send, sys_ipc_call and sys_ipc_call_msg.
+// With 'call' set, the caller also goes on to receive into 'dstva' once
+// its message has been delivered, without returning to user space in
+// between.
+static int
+ipc_send_block(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	       const void *msg, size_t msglen, bool call, void *dstva)
+{
+    struct Env * tgt_env;
+    int r;
+
+    if ((r = envid2env(envid, &tgt_env, 0)) != 0) {
+        return r;
+    }
+    if (tgt_env == curenv) {
+        return -E_INVAL;
+    }
+    env_lock_pair(curenv, tgt_env);
+    if (!env_still_valid(tgt_env, envid)) {
+        r = -E_BAD_ENV;
+        goto out;
+    }
+    if ((r = ipc_check_send(curenv, srcva, perm, msg, msglen)) < 0) {
+        goto out;
     }
 
-    //cprintf("[try_send]2\n");
-    if (r == 0) {
-        if (tgt_env->env_ipc_recving) {
-            tgt_env->env_ipc_recving = 0;
-            tgt_env->env_ipc_from    = curenv->env_id;
-            tgt_env->env_ipc_value   = value;
-            if ((srcva < (void*)UTOP) && (tgt_env->env_ipc_dstva < (void*)UTOP)) {
-                tgt_env->env_ipc_perm    = perm;
-                sys_page_map(tgt_env->env_ipc_from, srcva,
-                             envid, tgt_env->env_ipc_dstva, perm);
-                //cprintf("map, src:%x, destva: %x, content:%x,r:%d\n", srcva,tgt_env->env_ipc_dstva, (*(uint32_t*)tgt_env->env_ipc_dstva),r);
-            }
-            else {
-                tgt_env->env_ipc_perm    = 0;
-            }
-            tgt_env->env_tf.tf_regs.reg_eax = 0;
-            tgt_env->env_status             = ENV_RUNNABLE;
-            //cprintf("\n[sys_ipc_try_send]cpu:%d, %x send successfully, set %x runnable, set return value eax:%x\n",curenv->env_cpunum, curenv->env_id, tgt_env->env_id, tgt_env->env_tf.tf_regs.reg_eax);
-            return 0;
+    if (ipc_recving_from(tgt_env, curenv)) {
+        if ((r = ipc_deliver(curenv, tgt_env, value, srcva, perm,
+                             msg, msglen)) < 0) {
+            goto out;
         }
-        else {
-            return -E_IPC_NOT_RECV;
+        tgt_env->env_tf.tf_regs.reg_eax = 0;
+        sched_set_status(tgt_env, ENV_RUNNABLE);
+        if (!call) {
+            curenv->env_ipc_handoff = tgt_env->env_id;
+            goto out;
         }
+        // Wait for the reply, and let the target run on our time.
+        curenv->env_ipc_recving = 1;
+        curenv->env_ipc_recv_from = tgt_env->env_id;
+        curenv->env_ipc_dstva   = dstva;
     }
     else {
-        return r;
+        // Wait on the target's sender queue.  The receiver fills in
+        // our return value when it takes the message, or, for a call,
+        // leaves us blocked receiving the reply.
+        curenv->env_ipc_send_to    = tgt_env->env_id;
+        curenv->env_ipc_send_value = value;
+        curenv->env_ipc_send_srcva = srcva;
+        curenv->env_ipc_send_perm  = perm;
+        curenv->env_ipc_send_msg   = msg;
+        curenv->env_ipc_send_msglen = msglen;
+        curenv->env_ipc_send_call  = call;
+        curenv->env_ipc_dstva      = dstva;
+        ipc_sendq_push(tgt_env, curenv);
+    }
+    envid = tgt_env->env_id;
+    sched_set_status(curenv, ENV_NOT_RUNNABLE);
+    // See sys_ipc_recv
+    lcr3(PADDR(kern_pgdir));
+    env_unlock_pair(curenv, tgt_env);
+    if (call) {
+        sched_handoff(envid);
+    }
+    sched_yield();
+
+out:
+    env_unlock_pair(curenv, tgt_env);
+    return r;
+}
+
+// Send 'value' (and the page at 'srcva', as in sys_ipc_try_send) to
+// 'envid', blocking until it is delivered.  If the target is not
+// currently in sys_ipc_recv, the caller is queued on the target and
+// sleeps; the target's next sys_ipc_recv takes messages from its queued
+// senders in FIFO order before blocking.  A target waiting for the
+// reply to its own sys_ipc_call takes only that reply; other senders
+// queue.
+//
+// Returns 0 once the message has been delivered, < 0 on error.
+// Errors are those of sys_ipc_try_send except -E_IPC_NOT_RECV, plus:
+//	-E_INVAL if envid is the caller itself.
+//	-E_BAD_ENV if the target exits before receiving the message.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    return ipc_send_block(envid, value, srcva, perm, NULL, 0, 0, (void*)UTOP);
+}
+
+// Send a request as in sys_ipc_send, then wait for the reply as in
+// sys_ipc_recv(dstva), all in one system call.  If the target was
+// waiting, this CPU switches straight to it.
+//
+// Returns 0 once the reply has arrived, < 0 on error.  Errors are
+// those of sys_ipc_send and sys_ipc_recv.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+    if (((uint32_t)dstva < UTOP) && ((uint32_t)dstva % PGSIZE)) {
+        return -E_INVAL;
+    }
+    return ipc_send_block(envid, value, srcva, perm, NULL, 0, 1, dstva);
+}
+
+// Like sys_ipc_call, but send the 'msglen'-byte message at 'msg'
+// (at most IPC_MSG_MAX bytes) instead of a page.  The kernel copies it
+// into the target's env_ipc_msg, so small requests need no page
+// mapping on either side.
+static int
+sys_ipc_call_msg(envid_t envid, uint32_t value, const void *msg,
+		 size_t msglen, void *dstva)
+{
+    if (((uint32_t)dstva < UTOP) && ((uint32_t)dstva % PGSIZE)) {
+        return -E_INVAL;
     }
+    return ipc_send_block(envid, value, (void*)UTOP, 0, msg, msglen,
+                          1, dstva);
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -461,32 +1138,136 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'deadline' is not 0, give up at that time_msec() value: the system
+// call then fails with -E_TIMEOUT.  A deadline that has already passed
+// only takes a message that is already waiting.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if the deadline passed with no message.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t deadline)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_recv not implemented");
 
+    envid_t handoff;
+    struct Env * snd_env;
+    int r;
+
     // check dstva
     if (((uint32_t)dstva < UTOP) && ((uint32_t)dstva % PGSIZE)) {
         return -E_INVAL;
     }
-    
+
+    // Take the message of the oldest sender blocked in sys_ipc_send,
+    // if there is one, and return without blocking.  A queued sender
+    // whose page went away meanwhile gets the error and we try the next.
+    // Senders are queued on us under our lock, so once we find the
+    // queue empty we keep the lock until we are marked receiving: a
+    // sender that comes along then delivers to us directly.
+    for (;;) {
+        env_lock(curenv);
+        if (!(snd_env = ipc_sendq_head(curenv))) {
+            break;
+        }
+        env_unlock(curenv);
+        env_lock_pair(curenv, snd_env);
+        if (!ipc_sendq_take(curenv, snd_env)) {
+            // It exited meanwhile: look at the new head
+            env_unlock_pair(curenv, snd_env);
+            continue;
+        }
+        curenv->env_ipc_dstva = dstva;
+        r = ipc_deliver(snd_env, curenv, snd_env->env_ipc_send_value,
+                        snd_env->env_ipc_send_srcva,
+                        snd_env->env_ipc_send_perm,
+                        snd_env->env_ipc_send_msg,
+                        snd_env->env_ipc_send_msglen);
+        snd_env->env_ipc_send_to = 0;
+        if (r == 0 && snd_env->env_ipc_send_call) {
+            // A caller stays blocked, now waiting for our reply
+            snd_env->env_ipc_recving = 1;
+            snd_env->env_ipc_recv_from = curenv->env_id;
+        }
+        else {
+            snd_env->env_tf.tf_regs.reg_eax = r;
+            sched_set_status(snd_env, ENV_RUNNABLE);
+        }
+        env_unlock_pair(curenv, snd_env);
+        if (r == 0) {
+            return 0;
+        }
+    }
+
+    if (deadline && !msec_before(time_msec(), deadline)) {
+        env_unlock(curenv);
+        return -E_TIMEOUT;
+    }
+
+    // If our last send woke a receiver, we are most likely a client
+    // waiting for its reply (or a server that just replied), so hand
+    // this CPU straight to it instead of going through the scheduler.
+    handoff = curenv->env_ipc_handoff;
+    curenv->env_ipc_handoff = 0;
+
     curenv->env_ipc_recving = 1;
-    if ((uint32_t)dstva < UTOP) {
-        curenv->env_ipc_dstva   = dstva;
-    } 
-    while (curenv->env_ipc_recving){
-        //cprintf("\n[sys_ipc_recv]cpu:%d, set %x not runnable\n", curenv->env_cpunum, curenv->env_id, curenv->env_cpunum);
-        curenv->env_status = ENV_NOT_RUNNABLE; 
-        sched_yield();
+    curenv->env_ipc_recv_from = 0;
+    curenv->env_ipc_dstva   = dstva;
+    //cprintf("\n[sys_ipc_recv]cpu:%d, set %x not runnable\n", curenv->env_cpunum, curenv->env_id, curenv->env_cpunum);
+    sched_set_status(curenv, ENV_NOT_RUNNABLE);
+    if (deadline) {
+        timer_arm(curenv, deadline);
     }
+    // As soon as we unlock, a sender on another CPU may wake us and
+    // some CPU may run us, exit us and free our page directory, so stop
+    // using it first.
+    lcr3(PADDR(kern_pgdir));
+    env_unlock(curenv);
+    sched_handoff(handoff);
+    sched_yield();
+}
 
-	return 0;
+// Reply to 'envid' as in sys_ipc_try_send, then wait for the next
+// message as in sys_ipc_recv(dstva), all in one system call.  This is
+// the server side of sys_ipc_call: the client is already blocked
+// waiting for the reply, so the reply never has to be retried.  If
+// envid is 0, there is nothing to reply to and this only receives.
+//
+// Returns 0 once the next message has arrived, < 0 on error.  If the
+// reply fails, its error is returned without receiving.
+static int
+ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	       const void *msg, size_t msglen, void *dstva)
+{
+    int r;
+
+    if (((uint32_t)dstva < UTOP) && ((uint32_t)dstva % PGSIZE)) {
+        return -E_INVAL;
+    }
+    if (envid && (r = ipc_try_send(envid, value, srcva, perm,
+                                   msg, msglen)) < 0) {
+        return r;
+    }
+    return sys_ipc_recv(dstva, 0);
+}
+
+static int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva,
+		   unsigned perm, void *dstva)
+{
+    return ipc_reply_recv(envid, value, srcva, perm, NULL, 0, dstva);
+}
+
+// Like sys_ipc_reply_recv, but reply with the 'msglen'-byte message at
+// 'msg' instead of a page, as in sys_ipc_call_msg.
+static int
+sys_ipc_reply_recv_msg(envid_t envid, uint32_t value, const void *msg,
+		       size_t msglen, void *dstva)
+{
+    return ipc_reply_recv(envid, value, (void*)UTOP, 0, msg, msglen, dstva);
 }
 
 // Return the current time.
@@ -498,6 +1279,43 @@ sys_time_msec(void)
     return time_msec();
 }
 
+// Block until time_msec() reaches 'deadline'.  Returns 0 at once if it
+// already has; otherwise the system call returns 0 after the wakeup.
+static int
+sys_sleep_until(uint32_t deadline)
+{
+    if (!msec_before(time_msec(), deadline)) {
+        return 0;
+    }
+
+    env_lock(curenv);
+    curenv->env_tf.tf_regs.reg_eax = 0;
+    sched_set_status(curenv, ENV_NOT_RUNNABLE);
+    timer_arm(curenv, deadline);
+    // Stop using our page directory before another CPU can run us.
+    lcr3(PADDR(kern_pgdir));
+    env_unlock(curenv);
+    sched_yield();
+}
+
+// Store the time since boot in microseconds at 'usec'.
+static int
+sys_time_usec(uint64_t *usec)
+{
+    user_mem_assert(curenv, usec, sizeof(*usec), PTE_U | PTE_W);
+    *usec = time_usec();
+    return 0;
+}
+
+// Store the time since boot in nanoseconds at 'nsec'.
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+    user_mem_assert(curenv, nsec, sizeof(*nsec), PTE_U | PTE_W);
+    *nsec = time_nsec();
+    return 0;
+}
+
 /*  system call for packet transmit
  *  check packet address before call transmit_pkt function
  *      -E_INVAL if pkt >= UTOP
@@ -520,6 +1338,62 @@ sys_receive_pkt (uint16_t* length, char* rx_data) {
     return receive_pkt(length, rx_data);
 }
 
+// Run the 'n' system calls described by 'descs' in one kernel entry,
+// storing each one's return value in its sd_ret.  Only calls that
+// return without blocking may be batched: page_alloc, page_map,
+// page_unmap, vm_reserve, env_set_status, env_set_pgfault_upcall and
+// getenvid.
+// Any other entry fails with -E_INVAL and the rest still run.
+//
+// Returns the number of entries run, < 0 on error.  Errors are:
+//	-E_INVAL if n > SYSBATCH_MAX.
+//	-E_FAULT if an entry cannot be read, or its sd_ret cannot be
+//		written (for example because an earlier entry made that page
+//		copy-on-write); no later entries are run.
+static int
+sys_batch(struct SyscallDesc *descs, size_t n)
+{
+    struct SyscallDesc d;
+    size_t i;
+    int r;
+
+    if (n > SYSBATCH_MAX) {
+        return -E_INVAL;
+    }
+    // Other CPUs running our threads flush their TLBs once, at the end
+    tlb_batch_begin();
+    r = n;
+    for (i = 0; i < n; i++) {
+        if (user_mem_check(curenv, &descs[i], sizeof(d), PTE_U) < 0) {
+            r = -E_FAULT;
+            break;
+        }
+        d = descs[i];
+        switch (d.sd_num) {
+        case SYS_page_alloc:
+        case SYS_page_map:
+        case SYS_page_unmap:
+        case SYS_vm_reserve:
+        case SYS_env_set_status:
+        case SYS_env_set_pgfault_upcall:
+        case SYS_getenvid:
+            d.sd_ret = syscall(d.sd_num, d.sd_args[0], d.sd_args[1],
+                               d.sd_args[2], d.sd_args[3], d.sd_args[4]);
+            break;
+        default:
+            d.sd_ret = -E_INVAL;
+        }
+        // Re-check: the call may have changed our own mappings
+        if (user_mem_check(curenv, &descs[i].sd_ret, sizeof(d.sd_ret),
+                           PTE_U|PTE_W) < 0) {
+            r = -E_FAULT;
+            break;
+        }
+        descs[i].sd_ret = d.sd_ret;
+    }
+    tlb_batch_end();
+    return r;
+}
 
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
@@ -551,10 +1425,16 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         // bocui: for lab 4 exe 7
         case SYS_exofork:
             return sys_exofork();
+        case SYS_fork:
+            return sys_fork();
+        case SYS_sfork:
+            return sys_sfork((void*)a1, a2);
+        case SYS_vm_reserve:
+            return sys_vm_reserve(a1, (void*)a2, a3, a4);
         case SYS_env_set_status:
             return sys_env_set_status(a1, a2);
         case SYS_page_alloc:
-            return sys_page_alloc(a1, (void*)a2, a3);
+            return sys_page_alloc(a1, (void*)a2, a3, a4);
         case SYS_page_map:
             return sys_page_map(a1, (void*)a2, a3, (void*)a4, a5);
         case SYS_page_unmap:
@@ -566,13 +1446,39 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_ipc_try_send:
             return sys_ipc_try_send(a1, a2, (void*)a3, (unsigned)a4);
         case SYS_ipc_recv:
-            return sys_ipc_recv((void*)a1);
+            return sys_ipc_recv((void*)a1, a2);
+        case SYS_ipc_send:
+            return sys_ipc_send(a1, a2, (void*)a3, (unsigned)a4);
+        case SYS_ipc_call:
+            return sys_ipc_call(a1, a2, (void*)a3, (unsigned)a4, (void*)a5);
+        case SYS_ipc_reply_recv:
+            return sys_ipc_reply_recv(a1, a2, (void*)a3, (unsigned)a4, (void*)a5);
+        case SYS_ipc_call_msg:
+            return sys_ipc_call_msg(a1, a2, (const void*)a3, a4, (void*)a5);
+        case SYS_ipc_reply_recv_msg:
+            return sys_ipc_reply_recv_msg(a1, a2, (const void*)a3, a4, (void*)a5);
+        case SYS_batch:
+            return sys_batch((struct SyscallDesc*)a1, a2);
         // bocui: for lab5 exe 7
         case SYS_env_set_trapframe:
             return sys_env_set_trapframe((envid_t)a1, (struct Trapframe*)a2);
         // bocui: for lab6 exe 1
         case SYS_time_msec:
             return sys_time_msec();
+        case SYS_env_set_priority:
+            return sys_env_set_priority(a1, a2, a3);
+        case SYS_env_set_affinity:
+            return sys_env_set_affinity(a1, a2);
+        case SYS_ncpu:
+            return sys_ncpu();
+        case SYS_page_alloc_contig:
+            return sys_page_alloc_contig(a1, (void*)a2, a3, a4, (physaddr_t*)a5);
+        case SYS_sleep_until:
+            return sys_sleep_until(a1);
+        case SYS_time_usec:
+            return sys_time_usec((uint64_t*)a1);
+        case SYS_time_nsec:
+            return sys_time_nsec((uint64_t*)a1);
         // bocui for lab6 exe 7
         case SYS_transmit_pkt:
             return sys_transmit_pkt((uint16_t)a1, (char*)a2);
@@ -1,26 +1,72 @@
 #include <kern/time.h>
+#include <kern/kclock.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
+
+// The page published to user environments at UTIME (see mem_init).
+struct TimeInfo *timeinfo;
 
 static unsigned int ticks;
 
+// Start the clock at zero.  Uses the TSC rate that kclock_calibrate
+// measured; without one, the clock only advances 10 ms per tick.
 void
 time_init(void)
 {
+	uint32_t shift = 32;
+
 	ticks = 0;
+	timeinfo->ti_tsc = read_tsc();
+	timeinfo->ti_nsec = 0;
+	if (tsc_freq == 0)
+		return;
+	// Largest scale at which ns per cycle still fits in 32 bits
+	while (shift > 0 && (NSEC_PER_SEC << shift) / tsc_freq > 0xffffffff)
+		shift--;
+	timeinfo->ti_tsc_mult = (NSEC_PER_SEC << shift) / tsc_freq;
+	timeinfo->ti_tsc_shift = shift;
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+// Called on the boot CPU's timer interrupts: every 10 ms while the
+// LAPIC timer is periodic, and less often once sched_timer_arm makes
+// it one-shot.  Moves the base of the TSC interpolation forward so
+// that readers convert shorter intervals.
 void
 time_tick(void)
 {
+	uint64_t now = read_tsc();
+
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+
+	timeinfo->ti_seq++;
+	asm volatile("" ::: "memory");
+	if (timeinfo->ti_tsc_mult)
+		timeinfo->ti_nsec += tsc_to_nsec(now - timeinfo->ti_tsc,
+						 timeinfo->ti_tsc_mult,
+						 timeinfo->ti_tsc_shift);
+	else
+		timeinfo->ti_nsec += 10 * NSEC_PER_MSEC;
+	timeinfo->ti_tsc = now;
+	asm volatile("" ::: "memory");
+	timeinfo->ti_seq++;
+}
+
+uint64_t
+time_nsec(void)
+{
+	return timeinfo_nsec(timeinfo);
+}
+
+uint64_t
+time_usec(void)
+{
+	return time_nsec() / NSEC_PER_USEC;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / NSEC_PER_MSEC;
 }
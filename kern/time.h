@@ -4,8 +4,14 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/time.h>
+
+extern struct TimeInfo *timeinfo;
+
 void time_init(void);
 void time_tick(void);
 unsigned int time_msec(void);
+uint64_t time_usec(void);
+uint64_t time_nsec(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -0,0 +1,180 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/time.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/cpu.h>
+
+static struct spinlock timer_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "timer_lock"
+#endif
+};
+
+// Environments with an armed timer, as a binary min-heap ordered by
+// env_timer_deadline.  Each env records its index in env_timer_idx, so
+// arming and cancelling cost O(log n), and checking for expired timers
+// on every tick only looks at the root.
+static struct Env *timer_heap[NENV];
+static uint32_t timer_nheap;
+
+static void
+heap_set(uint32_t i, struct Env *e)
+{
+	timer_heap[i] = e;
+	e->env_timer_idx = i;
+}
+
+static void
+heap_sift_up(uint32_t i)
+{
+	struct Env *e = timer_heap[i];
+
+	while (i > 0 && msec_before(e->env_timer_deadline,
+				    timer_heap[(i - 1) / 2]->env_timer_deadline)) {
+		heap_set(i, timer_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(i, e);
+}
+
+static void
+heap_sift_down(uint32_t i)
+{
+	struct Env *e = timer_heap[i];
+	uint32_t c;
+
+	while ((c = 2 * i + 1) < timer_nheap) {
+		if (c + 1 < timer_nheap &&
+		    msec_before(timer_heap[c + 1]->env_timer_deadline,
+				timer_heap[c]->env_timer_deadline))
+			c++;
+		if (!msec_before(timer_heap[c]->env_timer_deadline,
+				 e->env_timer_deadline))
+			break;
+		heap_set(i, timer_heap[c]);
+		i = c;
+	}
+	heap_set(i, e);
+}
+
+static void
+heap_remove(struct Env *e)
+{
+	uint32_t i = e->env_timer_idx;
+	struct Env *last = timer_heap[--timer_nheap];
+
+	if (i != timer_nheap) {
+		heap_set(i, last);
+		heap_sift_up(i);
+		heap_sift_down(last->env_timer_idx);
+	}
+	e->env_timer_idx = -1;
+}
+
+// Wake e at 'deadline' unless something else makes it runnable first,
+// which cancels the timer (see sched_set_status).  The caller must hold
+// env_lock(e) and is about to block e with ENV_NOT_RUNNABLE.
+void
+timer_arm(struct Env *e, uint32_t deadline)
+{
+	bool first;
+
+	spin_lock(&timer_lock);
+	if (e->env_timer_idx >= 0)
+		heap_remove(e);
+	e->env_timer_deadline = deadline;
+	e->env_timer_armed = 1;
+	heap_set(timer_nheap++, e);
+	heap_sift_up(e->env_timer_idx);
+	first = (e->env_timer_idx == 0);
+	spin_unlock(&timer_lock);
+
+	// The boot CPU times the earliest deadline; make it re-arm.
+	if (first) {
+		bootcpu->cpu_timer_stale = 1;
+		sched_kick(bootcpu);
+	}
+}
+
+// Disarm e's timer.  The caller must hold env_lock(e).
+void
+timer_cancel(struct Env *e)
+{
+	spin_lock(&timer_lock);
+	if (e->env_timer_idx >= 0)
+		heap_remove(e);
+	e->env_timer_armed = 0;
+	spin_unlock(&timer_lock);
+}
+
+// Wake every environment whose deadline has passed.  A sleeper's
+// sys_sleep_until returns 0; a receiver's sys_ipc_recv fails with
+// -E_TIMEOUT.  Called on every CPU's timer interrupts, with no locks
+// held.
+void
+timer_expire(void)
+{
+	uint32_t now;
+	struct Env *e;
+
+	if (timer_nheap == 0)
+		return;
+	now = time_msec();
+	for (;;) {
+		spin_lock(&timer_lock);
+		if (timer_nheap == 0 ||
+		    msec_before(now, timer_heap[0]->env_timer_deadline)) {
+			spin_unlock(&timer_lock);
+			break;
+		}
+		e = timer_heap[0];
+		heap_remove(e);
+		spin_unlock(&timer_lock);
+
+		// env_lock comes before timer_lock, so e was unlocked in
+		// between; skip it if its timer was cancelled (and maybe
+		// armed again) meanwhile.
+		env_lock(e);
+		if (e->env_timer_armed && e->env_timer_idx < 0) {
+			e->env_timer_armed = 0;
+			if (e->env_status == ENV_NOT_RUNNABLE) {
+				if (e->env_ipc_recving) {
+					e->env_ipc_recving = 0;
+					e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+				}
+				sched_set_status(e, ENV_RUNNABLE);
+			}
+		}
+		env_unlock(e);
+	}
+}
+
+// Store the earliest armed deadline in *deadline and return true, or
+// return false if no timer is armed.
+bool
+timer_next(uint32_t *deadline)
+{
+	bool armed = 0;
+
+	if (timer_nheap == 0)
+		return 0;
+	spin_lock(&timer_lock);
+	if (timer_nheap > 0) {
+		*deadline = timer_heap[0]->env_timer_deadline;
+		armed = 1;
+	}
+	spin_unlock(&timer_lock);
+	return armed;
+}
+
+// Number of armed timers.  Environments waiting on one will run again
+// even if nothing else in the system is runnable.
+uint32_t
+timer_npending(void)
+{
+	return timer_nheap;
+}
@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+// Deadline timers for environments blocked in sys_sleep_until or in
+// sys_ipc_recv with a timeout.  Deadlines are in time_msec() units.
+void timer_arm(struct Env *e, uint32_t deadline);
+void timer_cancel(struct Env *e);
+void timer_expire(void);
+bool timer_next(uint32_t *deadline);
+uint32_t timer_npending(void);
+
+#endif	// !JOS_KERN_TIMER_H
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/string.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -14,6 +15,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/timer.h>
 
 static struct Taskstate ts;
 
@@ -100,6 +102,8 @@ trap_init(void)
     SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL],   0, GD_KT, &serial,   0);   
     SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, &spurious, 0);
     SETGATE(idt[IRQ_OFFSET + IRQ_IDE],      0, GD_KT, &ide,      0); 
+    SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED],  0, GD_KT, &resched,  0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_TLB],      0, GD_KT, &tlbshoot, 0);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -142,6 +146,17 @@ trap_init_percpu(void)
     //if (thiscpu->cpu_id != 0) {
     ltr(GD_TSS0 + (thiscpu->cpu_id << 3));
     lidt(&idt_pd);
+
+    // Fast system calls: sysenter loads %cs/%ss from the CS MSR and
+    // %esp/%eip from the other two, so point them at this CPU's
+    // kernel stack and at sysenter_handler.
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    if (edx & CPUID_FEAT_SEP) {
+        wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+        wrmsr(MSR_IA32_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+        wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+    }
     return;
     //}
 
@@ -258,10 +273,28 @@ trap_dispatch(struct Trapframe *tf)
         if (thiscpu == bootcpu) {
             time_tick();
         }
+        // The one-shot has fired
+        thiscpu->cpu_timer_stale = 1;
+        timer_expire();
+        sched_yield();
+        return;
+    }
+
+    // Another CPU queued work for us, or wants our environment to
+    // notice that it is dying (see sched_kick).
+    if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+        lapic_eoi();
         sched_yield();
         return;
     }
 
+    // Another CPU changed page tables we may be using (see
+    // tlb_invalidate).
+    if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+        lapic_eoi();
+        tlb_shootdown_poll();
+        return;
+    }
 
 
 	// Handle keyboard and serial interrupts.
@@ -285,6 +318,29 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Save the user-mode state in 'tf' (on the kernel stack) into curenv
+// and return curenv's copy.  Does not return if curenv was destroyed
+// by another CPU while it was running here.
+static struct Trapframe *
+trap_save_user(struct Trapframe *tf)
+{
+	// Garbage collect if current enviroment is a zombie
+	if (curenv->env_status == ENV_DYING) {
+		env_lock(curenv);
+		env_free(curenv);
+		env_unlock(curenv);
+		curenv = NULL;
+		sched_yield();
+	}
+
+	// Copy trap frame (which is currently on the stack)
+	// into 'curenv->env_tf', so that running the environment
+	// will restart at the trap point.
+	curenv->env_tf = *tf;
+	// The trapframe on the stack should be ignored from here on.
+	return &curenv->env_tf;
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -297,10 +353,10 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
+	// We are no longer halted in sched_halt(), if we were
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+		sched_unidle();
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -308,28 +364,11 @@ trap(struct Trapframe *tf)
 	assert(!(read_eflags() & FL_IF));
 
 	if ((tf->tf_cs & 3) == 3) {
-		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-        //cprintf("[trap]trap from user, lock request, id:%x, cpu:%d\n",curenv->env_id, curenv->env_cpunum);
-        lock_kernel();
-        //cprintf("[trap]trap from user, lock get, id:%x, cpu:%d\n",curenv->env_id, curenv->env_cpunum);
+		// Trapped from user mode.  There is no big kernel lock;
+		// each subsystem locks what it touches.
 		assert(curenv);
 
-		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
-		}
-
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		tf = trap_save_user(tf);
 	}
 
 	// Record that tf is the last real trapframe so
@@ -341,13 +380,60 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	// if doing so makes sense and nothing more urgent is waiting.
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !thiscpu->cpu_resched)
 		env_run(curenv);
 	else
 		sched_yield();
 }
 
+// Called by sysenter_handler with a Trapframe laid out exactly as the
+// int $T_SYSCALL path builds it.  %esi and %ebp carry the user's return
+// address and stack, so at most four arguments come this way.  Returns
+// only when the environment can resume directly with sysexit, with the
+// result left in tf's %eax; otherwise it resumes from env_tf via iret,
+// or another environment is run.
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	struct Trapframe *etf;
+	int32_t r;
+
+	asm volatile("cld" ::: "cc");
+
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	assert(!(read_eflags() & FL_IF));
+	assert(curenv);
+
+	etf = trap_save_user(tf);
+	last_tf = etf;
+
+	r = syscall(etf->tf_regs.reg_eax, etf->tf_regs.reg_edx,
+		    etf->tf_regs.reg_ecx, etf->tf_regs.reg_ebx,
+		    etf->tf_regs.reg_edi, 0);
+	etf->tf_regs.reg_eax = r;
+
+	// A blocking system call may have given up the CPU, in which
+	// case the environment resumes later from env_tf via iret.
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !thiscpu->cpu_resched) {
+		tf->tf_regs.reg_eax = r;
+		// sysexit only restores what is in tf, so if the system
+		// call changed env_tf in any other way (an upcall, or
+		// sys_env_set_trapframe on ourselves), iret from env_tf.
+		// So does a single-stepping environment: restoring its TF
+		// before sysexit would trap in the kernel.
+		if (etf == &curenv->env_tf && !(tf->tf_eflags & FL_TF) &&
+		    memcmp(etf, tf, sizeof(*tf)) == 0)
+			return;
+		env_run(curenv);
+	}
+	sched_yield();
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
@@ -366,6 +452,31 @@ page_fault_handler(struct Trapframe *tf)
         panic("[page_fault_handler]Page fault in kernel at %x!\n", fault_va);
     }
 
+    // The first touch of a demand-zero page (see sys_vm_reserve) maps
+    // it without bothering the environment.
+    if (!(tf->tf_err & FEC_PR) && fault_va < UTOP) {
+        int r;
+
+        env_lock(curenv);
+        r = page_fault_in(curenv->env_pgdir, (void *) fault_va,
+                          tf->tf_err & FEC_WR);
+        env_unlock(curenv);
+        if (r > 0)
+            return;
+    }
+
+    // Writes to copy-on-write pages are resolved here, whether the
+    // mapping came from sys_fork or from the user-level ufork.
+    if ((tf->tf_err & FEC_WR) && fault_va < UTOP) {
+        int r;
+
+        env_lock(curenv);
+        r = page_cow_break(curenv->env_pgdir, (void *) fault_va);
+        env_unlock(curenv);
+        if (r > 0)
+            return;
+    }
+
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
@@ -401,8 +512,11 @@ page_fault_handler(struct Trapframe *tf)
     
     uint32_t  esp;
     uint32_t  recursive;
+    uintptr_t uxstacktop;
 
-    recursive = (tf->tf_esp < UXSTACKTOP) && (tf->tf_esp > UXSTACKTOP-PGSIZE);
+    // Threads made by sys_sfork each have their own exception stack
+    uxstacktop = curenv->env_uxstacktop;
+    recursive = (tf->tf_esp < uxstacktop) && (tf->tf_esp > uxstacktop-PGSIZE);
 
     if(curenv->env_pgfault_upcall) {
 
@@ -416,9 +530,9 @@ page_fault_handler(struct Trapframe *tf)
         }
         else {
             //cprintf("[page_fault_handler]size of trap frame:%x\n", sizeof(struct UTrapframe));
-            user_mem_assert(curenv, (void*)UXSTACKTOP - sizeof(struct UTrapframe), 
+            user_mem_assert(curenv, (void*)uxstacktop - sizeof(struct UTrapframe), 
                             sizeof(struct UTrapframe), PTE_W);
-            esp  = UXSTACKTOP;
+            esp  = uxstacktop;
         }
 
         esp -= sizeof(uintptr_t);
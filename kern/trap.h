@@ -19,6 +19,7 @@ void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
+void sysenter_trap(struct Trapframe *tf);
 
 //trap handler functions
 void divide();
@@ -40,11 +41,14 @@ void mchk();
 void simderr();
 
 void enter_syscall();
+void sysenter_handler();
 
 void timer();
 void kbd();
 void serial();
 void spurious();
 void ide();
+void resched();
+void tlbshoot();
 
 #endif /* JOS_KERN_TRAP_H */
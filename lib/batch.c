@@ -0,0 +1,53 @@
+// Collect system calls and run them in one kernel entry with sys_batch.
+
+#include <inc/lib.h>
+
+void
+batch_init(struct SysBatch *b)
+{
+	b->sb_n = 0;
+}
+
+// Queue system call 'num' with the given arguments, running the batch
+// first if it is full.  Returns 0, or the first error of the batch it
+// had to run.
+int
+batch_add(struct SysBatch *b, uint32_t num,
+	  uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SyscallDesc *d;
+	int r;
+
+	if (b->sb_n == SYSBATCH_MAX && (r = batch_flush(b)) < 0)
+		return r;
+	d = &b->sb_descs[b->sb_n++];
+	d->sd_num = num;
+	d->sd_args[0] = a1;
+	d->sd_args[1] = a2;
+	d->sd_args[2] = a3;
+	d->sd_args[3] = a4;
+	d->sd_args[4] = a5;
+	d->sd_ret = 0;
+	return 0;
+}
+
+// Run the queued system calls and empty the batch.  Each call's result
+// stays in b->sb_descs[i].sd_ret until the next batch_add.
+// Returns 0 if all of them succeeded, otherwise the first error.
+int
+batch_flush(struct SysBatch *b)
+{
+	size_t i, n;
+	int r;
+
+	n = b->sb_n;
+	b->sb_n = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_batch(b->sb_descs, n)) < 0)
+		return r;
+	for (i = 0; i < n; i++)
+		if (b->sb_descs[i].sd_ret < 0)
+			return b->sb_descs[i].sd_ret;
+	return 0;
+}
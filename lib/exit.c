@@ -4,7 +4,9 @@
 void
 exit(void)
 {
-	close_all();
+	// The file descriptor table is shared by all our threads.
+	if (__sync_sub_and_fetch(&thread_count, 1) == 0)
+		close_all();
 	sys_env_destroy(0);
 }
 
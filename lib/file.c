@@ -6,6 +6,8 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,7 +17,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -24,8 +25,24 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Send a small request to the file server in an IPC message instead of
+// in fsipcbuf, so that no page has to be mapped.  Only for requests the
+// server accepts this way (see serve()).  A reply message, if any, is
+// in thisenv->env_ipc_msg.
+static int
+fsipc_msg(unsigned type, const void *req, size_t len)
+{
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_msg %d\n", thisenv->env_id, type);
+
+	return ipc_call_msg(fsenv, type, req, len, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -99,8 +116,10 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	struct Fsreq_flush req;
+
+	req.req_fileid = fd->fd_file.id;
+	return fsipc_msg(FSREQ_FLUSH, &req, sizeof(req));
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -160,14 +179,17 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
+	struct Fsreq_stat req;
+	const struct Fsret_stat *ret;
 	int r;
 
-	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
+	req.req_fileid = fd->fd_file.id;
+	if ((r = fsipc_msg(FSREQ_STAT, &req, sizeof(req))) < 0)
 		return r;
-	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-	st->st_size = fsipcbuf.statRet.ret_size;
-	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	ret = (const struct Fsret_stat *) thisenv->env_ipc_msg;
+	strcpy(st->st_name, ret->ret_name);
+	st->st_size = ret->ret_size;
+	st->st_isdir = ret->ret_isdir;
 	return 0;
 }
 
@@ -175,9 +197,11 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	struct Fsreq_set_size req;
+
+	req.req_fileid = fd->fd_file.id;
+	req.req_size = newsize;
+	return fsipc_msg(FSREQ_SET_SIZE, &req, sizeof(req));
 }
 
 
@@ -188,6 +212,6 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_msg(FSREQ_SYNC, NULL, 0);
 }
 
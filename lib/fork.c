@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -40,7 +36,9 @@ pgfault(struct UTrapframe *utf)
 
 	//panic("pgfault not implemented");
 
-    if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+    // The copy below overwrites the whole page.
+    if ((r = sys_page_alloc_flags(0, PFTEMP, PTE_P|PTE_U|PTE_W,
+                                  SYS_PAGE_NOZERO)) < 0)
 		panic("sys_page_alloc: %e", r);
     memmove(PFTEMP, ROUNDDOWN(addr, PGSIZE), PGSIZE);
     if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
@@ -59,43 +57,73 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued on batch 'b' rather than made right away, so
+// that fork can make them all with a few sys_batch calls.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
-duppage(envid_t envid, unsigned pn)
+duppage(struct SysBatch *b, envid_t envid, unsigned pn)
 {
 	int r;
-    uint32_t * addr;
+    uint32_t addr;
 
-    addr = (uint32_t*) (pn*PGSIZE);
+    addr = pn*PGSIZE;
 
 	// LAB 4: Your code here.
 	// panic("duppage not implemented");
     
-    if (PGOFF(uvpt[pn]) & PTE_SHARE) {
+    r = 0;
+    if (!(uvpt[pn] & PTE_P)) {
+        // A demand-zero reservation stays one in the child
+        if (uvpt[pn] & PTE_ZERO)
+            r = batch_add(b, SYS_vm_reserve, envid, addr, PGSIZE,
+                          (uvpt[pn] & PTE_SYSCALL) | PTE_P, 0);
+    }
+    else if (PGOFF(uvpt[pn]) & PTE_SHARE) {
         //cprintf("[duppage]handle shared page\n");
-        if ((r = sys_page_map(0, (void*)addr, envid, (void*)addr, uvpt[pn] & PTE_SYSCALL)) < 0)
-	    	panic("sys_page_map child: %e", r);
+        r = batch_add(b, SYS_page_map, 0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL);
     }
     else if ((PGOFF(uvpt[pn]) & PTE_W) || (PGOFF(uvpt[pn]) & PTE_COW)) {
         //cprintf("writeable page: addr:%x\n", addr);
-        if ((r = sys_page_map(0, (void*)addr, envid, (void*)addr, PTE_P|PTE_U|PTE_COW)) < 0)
-	    	panic("sys_page_map child: %e", r);
+        if ((r = batch_add(b, SYS_page_map, 0, addr, envid, addr, PTE_P|PTE_U|PTE_COW)) < 0)
+            return r;
         //uvpt[pn] = uvpt[pn] | PTE_COW;
-        if ((r = sys_page_map(0, (void*)addr, 0, (void*)addr, PTE_P|PTE_U|PTE_COW)) < 0)
-	    	panic("sys_page_map parent: %e", r);
+        r = batch_add(b, SYS_page_map, 0, addr, 0, addr, PTE_P|PTE_U|PTE_COW);
     }
     else if (PGOFF(uvpt[pn] & PTE_P)){
         //cprintf("read only page: addr:%x\n", addr);
-        if ((r = sys_page_map(0, (void*)addr, envid, (void*)addr, PTE_P|PTE_U)) < 0)
-	    	panic("sys_page_map: %e", r);
+        r = batch_add(b, SYS_page_map, 0, addr, envid, addr, PTE_P|PTE_U);
     }
-	return 0;
+	return r;
+}
+
+//
+// Fork with copy-on-write, done by the kernel in one system call.
+// Write faults on the shared pages are resolved by the kernel too, so
+// neither environment needs a page fault handler.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	if ((envid = sys_fork()) < 0)
+		panic("sys_fork: %e", envid);
+	if (envid == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		thread_count = 1;
+	}
+	return envid;
 }
 
 //
-// User-level fork with copy-on-write.
+// User-level fork with copy-on-write, the exokernel way: the address
+// space is copied by duppage and the copy-on-write faults go through
+// our pgfault handler (unless the kernel resolves them first).
 // Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
@@ -111,13 +139,15 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
 	//panic("fork not implemented");
 
     envid_t envid;
     uint8_t *addr;
+    uint32_t stack;
+    struct SysBatch b;
     int r;
 	extern unsigned char end[];
     extern void _pgfault_upcall(void);
@@ -136,46 +166,93 @@ fork(void)
 		// Fix it and return 0.
         //cprintf("enter child, envid:%x\n",sys_getenvid());
 		thisenv = &envs[ENVX(sys_getenvid())];
+		thread_count = 1;
         return 0;
     }
 
     // parent
+    // Queue all the mappings and make them with a few sys_batch calls
+    // instead of one or two traps per page.  The batch lives on the one
+    // stack page, which duppage never makes copy-on-write.
+    batch_init(&b);
     //cprintf("end:%x\n", end);
     //for (addr = (uint8_t*) UTEXT; addr < end; addr += PGSIZE) {
     for (addr = (uint8_t*) UTEXT; addr < (uint8_t*)(USTACKTOP - PGSIZE); addr += PGSIZE) {
         if (uvpd[PDX(addr)]) {
            //cprintf("[fork]addr:%x, content:%x\n", addr, uvpt[PGNUM(addr)]);
-           duppage(envid, (unsigned)addr/PGSIZE);
+           if ((r = duppage(&b, envid, (unsigned)addr/PGSIZE)) < 0)
+               panic("duppage: %e", r);
         }
     }
 
     // copy the stack we are currently running on
-	if ((r = sys_page_alloc(envid, ROUNDDOWN(&addr, PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_alloc: %e", r);
-	if ((r = sys_page_map(envid, ROUNDDOWN(&addr, PGSIZE), 0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_map: %e", r);
-	memmove(UTEMP, ROUNDDOWN(&addr, PGSIZE), PGSIZE);
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
-		panic("sys_page_unmap: %e", r);
+    stack = (uint32_t) ROUNDDOWN(&addr, PGSIZE);
+    batch_add(&b, SYS_page_alloc, envid, stack, PTE_P|PTE_U|PTE_W, 0, 0);
+    batch_add(&b, SYS_page_map, envid, stack, 0, (uint32_t) UTEMP, PTE_P|PTE_U|PTE_W);
+    if ((r = batch_flush(&b)) < 0)
+        panic("fork: %e", r);
+    memmove(UTEMP, (void*) stack, PGSIZE);
+    batch_add(&b, SYS_page_unmap, 0, (uint32_t) UTEMP, 0, 0, 0);
     
     // create exception stack
-	if ((r = sys_page_alloc(envid, (void*)(UXSTACKTOP-PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
-		panic("[pgfalut]sys_page_alloc: %e", r);
+    batch_add(&b, SYS_page_alloc, envid, UXSTACKTOP-PGSIZE, PTE_P|PTE_U|PTE_W, 0, 0);
 
     // set entry point for child pgfault handler
-    sys_env_set_pgfault_upcall(envid, (uint32_t*)_pgfault_upcall);
+    batch_add(&b, SYS_env_set_pgfault_upcall, envid, (uint32_t) _pgfault_upcall, 0, 0, 0);
 
 	// Start the child environment running
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
+    batch_add(&b, SYS_env_set_status, envid, ENV_RUNNABLE, 0, 0, 0);
+    if ((r = batch_flush(&b)) < 0)
+        panic("fork: %e", r);
 
-	return envid;
+    return envid;
 }
 
-// Challenge!
-int
+// Number of threads sharing this address space, and the next free
+// thread slot (see THREAD_SLOT in inc/lib.h).
+volatile int thread_count = 1;
+static volatile uint32_t thread_next = 1;
+
+//
+// Create a thread: a child that shares our whole address space, our
+// page fault handler and (through the shared data segment) our file
+// descriptor table.  The child runs on its own stack page, which
+// starts out as a copy of ours.  Pointers into our stack held in
+// registers or in frames below sfork's caller's are not fixed up, so
+// the child should not follow them.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	uint32_t slot, top, old, *ebp;
+	envid_t envid;
+	int r;
+
+	slot = __sync_fetch_and_add(&thread_next, 1);
+	if (slot >= THREAD_MAX)
+		panic("sfork: out of thread slots");
+	top = USTACKTOP - slot * THREAD_SLOT;
+	if ((r = sys_page_alloc(0, (void *) (top - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0
+	    || (r = sys_page_alloc(0, (void *) (top - 3 * PGSIZE),
+				   PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sfork: %e", r);
+
+	old = ROUNDDOWN(read_esp(), PGSIZE);
+	__sync_fetch_and_add(&thread_count, 1);
+	if ((envid = sys_sfork((void *) (top - PGSIZE), top - 2 * PGSIZE)) < 0)
+		panic("sys_sfork: %e", envid);
+	if (envid == 0) {
+		// The kernel moved %esp and %ebp; move the saved frame
+		// pointers that still point into the parent's stack.
+		for (ebp = (uint32_t *) read_ebp();
+		     ROUNDDOWN((uint32_t) ebp, PGSIZE) == top - PGSIZE;
+		     ebp = (uint32_t *) *ebp)
+			if (*ebp >= old && *ebp < old + PGSIZE)
+				*ebp += top - PGSIZE - old;
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+	return envid;
 }
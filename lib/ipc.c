@@ -2,6 +2,35 @@
 
 #include <inc/lib.h>
 
+// Fill in the results of a receive that returned 'r', as described
+// for ipc_recv.
+static int32_t
+ipc_result(int r, envid_t *from_env_store, int *perm_store)
+{
+    if (from_env_store != NULL) {
+        if (r == 0) {
+            *from_env_store = thisenv->env_ipc_from;
+        }
+        else {
+            *from_env_store = 0;
+        }
+    }
+    if (perm_store != NULL) {
+        if (r == 0) {
+            *perm_store = thisenv->env_ipc_perm;
+        }
+        else {
+            *perm_store = 0;
+        }
+    }
+    if (r == 0) {
+	    return thisenv->env_ipc_value;
+    }
+    else {
+        return r;
+    }
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -35,37 +64,15 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
         r = sys_ipc_recv((void*)UTOP);
     }
 
-    if (from_env_store != NULL) {
-        if (r == 0) {
-            *from_env_store = thisenv->env_ipc_from;
-        }
-        else {
-            *from_env_store = 0;
-        }
-    }
-    if (perm_store != NULL) {
-        if (r == 0) {
-            *perm_store = thisenv->env_ipc_perm;
-        }
-        else {
-            *perm_store = 0;
-        }
-    }
-    if (r == 0) {
-	    return thisenv->env_ipc_value;
-    }
-    else {
-        return r;
-    }
+    return ipc_result(r, from_env_store, perm_store);
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until the message is delivered.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -74,29 +81,105 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	//panic("ipc_send not implemented");
 
     int r;
-    
+
+    // sys_ipc_send queues us in the kernel until 'to_env' receives,
+    // so there is no need to spin on sys_ipc_try_send and sys_yield.
     if (pg != NULL) {
-        r = sys_ipc_try_send(to_env, val, pg, perm);
+        r = sys_ipc_send(to_env, val, pg, perm);
     }
     else {
-        r = sys_ipc_try_send(to_env, val, (void*)UTOP, perm);
+        r = sys_ipc_send(to_env, val, (void*)UTOP, perm);
     }
-    //cprintf("\n[ipc_send]cpu:%d, %x, perm:%x, yield r:%e\n", thisenv->env_cpunum,thisenv->env_id, perm, r);
-    while (r != 0) {
-        //cprintf("\n[ipc_send]cpu:%d, %x yield r:%e\n", thisenv->env_cpunum,thisenv->env_id, r);
-        sys_yield();
-        //cprintf("\n[ipc_send] %x continue r:%e\n", thisenv->env_id, r);
-        if (pg != NULL) {
-            //cprintf("ddd\n");
-            r = sys_ipc_try_send(to_env, val, pg, perm);
-        }
-        else {
-            r = sys_ipc_try_send(to_env, val, (void*)UTOP, perm);
-        }
+    if (r < 0) {
+        panic("ipc_send: %e", r);
     }
     //cprintf("send successfully,r:%x\n",r);
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, as ipc_send followed by ipc_recv(NULL, rcv_pg,
+// perm_store) would, but in a single system call.  The reply's sender
+// is always 'to_env' for servers that use ipc_reply_recv.
+// Returns the reply value, or < 0 on error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+    int r;
+
+    r = sys_ipc_call(to_env, val, pg ? pg : (void*)UTOP, perm,
+                     rcv_pg ? rcv_pg : (void*)UTOP);
+    return ipc_result(r, NULL, perm_store);
+}
+
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// then receive the next message as ipc_recv(from_env_store, rcv_pg,
+// perm_store) does, in a single system call.  If 'to_env' is 0, only
+// receive.  A reply to a client that has exited is dropped.  Clients
+// should use ipc_call, which is always waiting for the reply; one that
+// used ipc_send instead gets the reply when it reaches ipc_recv, and
+// holds up the server until then.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+    int r;
+
+    if (pg == NULL) {
+        pg = (void*)UTOP;
+    }
+    if (rcv_pg == NULL) {
+        rcv_pg = (void*)UTOP;
+    }
+    r = sys_ipc_reply_recv(to_env, val, pg, perm, rcv_pg);
+    if (r == -E_IPC_NOT_RECV || r == -E_BAD_ENV) {
+        // The reply was not delivered.  Either the client used
+        // ipc_send instead of ipc_call and has not reached ipc_recv
+        // yet, so leave the reply queued on it in the kernel until it
+        // does, or it has exited.
+        if (r == -E_IPC_NOT_RECV) {
+            sys_ipc_send(to_env, val, pg, perm);
+        }
+        r = sys_ipc_recv(rcv_pg);
+    }
+    return ipc_result(r, from_env_store, perm_store);
+}
+
+// Like ipc_call, but send the 'len'-byte message at 'msg' (at most
+// IPC_MSG_MAX bytes) instead of a page.  The kernel copies it into the
+// receiver's env_ipc_msg, so no page is mapped or unmapped.  A reply
+// message, if any, is in thisenv->env_ipc_msg.
+int32_t
+ipc_call_msg(envid_t to_env, uint32_t val, const void *msg, size_t len,
+	     void *rcv_pg, int *perm_store)
+{
+    int r;
+
+    r = sys_ipc_call_msg(to_env, val, msg, len,
+                         rcv_pg ? rcv_pg : (void*)UTOP);
+    return ipc_result(r, NULL, perm_store);
+}
+
+// Like ipc_reply_recv, but reply with the 'len'-byte message at 'msg'
+// instead of a page.  Only for clients that used ipc_call_msg, which
+// always wait for their reply; a reply that cannot be delivered is
+// dropped.
+int32_t
+ipc_reply_recv_msg(envid_t to_env, uint32_t val, const void *msg, size_t len,
+		   envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+    int r;
+
+    if (rcv_pg == NULL) {
+        rcv_pg = (void*)UTOP;
+    }
+    r = sys_ipc_reply_recv_msg(to_env, val, msg, len, rcv_pg);
+    if (r == -E_IPC_NOT_RECV || r == -E_BAD_ENV) {
+        r = sys_ipc_recv(rcv_pg);
+    }
+    return ipc_result(r, from_env_store, perm_store);
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -14,6 +14,9 @@
  * If we need to allocate a large amount (more than a page)
  * we can't put a ref count at the end of each page,
  * so we mark the pte entry with the bit PTE_CONTINUED.
+ *
+ * Pages are only reserved demand-zero (see sys_vm_reserve), so
+ * the parts of a large chunk that are never touched cost no memory.
  */
 enum
 {
@@ -26,6 +29,10 @@ static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
 static uint8_t *mptr;
 
+// Not on the stack: lwIP threads run on small malloc'ed stacks.  The
+// batches below never change the mapping of the page holding it.
+static struct SysBatch mbatch;
+
 static int
 isfree(void *v, size_t n)
 {
@@ -33,7 +40,8 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		    || ((uvpd[PDX(va)] & PTE_P)
+			&& (uvpt[PGNUM(va)] & (PTE_P|PTE_ZERO))))
 			return 0;
 	return 1;
 }
@@ -41,7 +49,7 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	int i, r;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
@@ -93,15 +101,28 @@ malloc(size_t n)
 	}
 
 	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * reserve at mptr - the +4 makes sure we allocate a ref count.
+	 * all but the last page are continued, so two calls will do.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	i = ROUNDUP(n + 4, PGSIZE);
+	batch_init(&mbatch);
+	r = 0;
+	if (i > PGSIZE)
+		r = batch_add(&mbatch, SYS_vm_reserve, 0, (uint32_t) mptr,
+			      i - PGSIZE, PTE_P|PTE_U|PTE_W|PTE_CONTINUED, 0);
+	if (r == 0)
+		r = batch_add(&mbatch, SYS_vm_reserve, 0,
+			      (uint32_t) (mptr + i - PGSIZE), PGSIZE,
+			      PTE_P|PTE_U|PTE_W, 0);
+	if (r == 0)
+		r = batch_flush(&mbatch);
+	if (r < 0) {
+		batch_init(&mbatch);
+		for (i -= PGSIZE; i >= 0; i -= PGSIZE)
+			batch_add(&mbatch, SYS_page_unmap, 0,
+				  (uint32_t) (mptr + i), 0, 0, 0);
+		batch_flush(&mbatch);
+		return 0;	/* out of physical memory */
 	}
 
 	ref = (uint32_t*) (mptr + i - 4);
@@ -123,11 +144,13 @@ free(void *v)
 
 	c = ROUNDDOWN(v, PGSIZE);
 
+	batch_init(&mbatch);
 	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
+		batch_add(&mbatch, SYS_page_unmap, 0, (uint32_t) c, 0, 0, 0);
 		c += PGSIZE;
 		assert(mbegin <= c && c < mend);
 	}
+	batch_flush(&mbatch);
 
 	/*
 	 * c is just a piece of this page, so dec the ref count
@@ -8,6 +8,8 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t nsenv;
+
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
@@ -16,7 +18,6 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
@@ -25,8 +26,21 @@ nsipc(unsigned type)
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Send a small request that needs no reply data in an IPC message
+// instead of in nsipcbuf, so that no page has to be mapped.
+static int
+nsipc_msg(unsigned type, const void *req, size_t len)
+{
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+
+	if (debug)
+		cprintf("[%08x] nsipc_msg %d\n", thisenv->env_id, type);
+
+	return ipc_call_msg(nsenv, type, req, len, NULL, NULL);
 }
 
 int
@@ -56,16 +70,20 @@ nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 int
 nsipc_shutdown(int s, int how)
 {
-	nsipcbuf.shutdown.req_s = s;
-	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	struct Nsreq_shutdown req;
+
+	req.req_s = s;
+	req.req_how = how;
+	return nsipc_msg(NSREQ_SHUTDOWN, &req, sizeof(req));
 }
 
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	struct Nsreq_close req;
+
+	req.req_s = s;
+	return nsipc_msg(NSREQ_CLOSE, &req, sizeof(req));
 }
 
 int
@@ -80,9 +98,11 @@ nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
-	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	struct Nsreq_listen req;
+
+	req.req_s = s;
+	req.req_backlog = backlog;
+	return nsipc_msg(NSREQ_LISTEN, &req, sizeof(req));
 }
 
 int
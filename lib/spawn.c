@@ -276,26 +276,25 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
+	for (i = 0; i < memsz && i < filesz; i += PGSIZE) {
+		// from file
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+			return r;
+		if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+			panic("spawn: sys_page_map data: %e", r);
             //cprintf("[map_segment]addr:%x, content:%x, perm:%x\n", (va+i), uvpt[PGNUM(UTEMP)], perm);
             //cprintf("[map_segment]addr:%x, content:%x, perm:%x\n", (va+i), uvpt[PGNUM(va+i)], perm);
-			sys_page_unmap(0, UTEMP);
-		}
+		sys_page_unmap(0, UTEMP);
 	}
+	// The blank pages are only reserved; the child's first touch of
+	// each one allocates it.
+	if (i < memsz
+	    && (r = sys_vm_reserve(child, (void*) (va + i), memsz - i, perm)) < 0)
+		return r;
 	return 0;
 }
 
@@ -306,17 +305,21 @@ copy_shared_pages(envid_t child)
 	// LAB 5: Your code here.
 
     uint32_t addr;
+    struct SysBatch b;
     int r;
     //cprintf("[copy_shared_pages]child id:%x\n", child);
+    batch_init(&b);
     for (addr = UTEXT; addr < (USTACKTOP - PGSIZE); addr += PGSIZE) {
         if (uvpd[PDX(addr)]) {
             if (PGOFF(uvpt[PGNUM(addr)]) & PTE_SHARE) {
                 //cprintf("[copy_shared_pages]addr:%x, content:%x\n", addr, uvpt[PGNUM(addr)]);
-                if ((r = sys_page_map(0, (void*)addr, child, (void*)addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+                if ((r = batch_add(&b, SYS_page_map, 0, addr, child, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
 	            	panic("sys_page_map child: %e", r);
             }
         }
     }
-	return 0;
+    if ((r = batch_flush(&b)) < 0)
+        panic("sys_page_map child: %e", r);
+    return 0;
 }
 
@@ -2,6 +2,23 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether this CPU supports sysenter: 0 unknown, 1 yes, -1 no.
+// Every CPU JOS boots is the same model, so checking once is enough.
+static int sysenter_state;
+
+static inline bool
+sysenter_ok(void)
+{
+	uint32_t edx;
+
+	if (sysenter_state == 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sysenter_state = (edx & CPUID_FEAT_SEP) ? 1 : -1;
+	}
+	return sysenter_state > 0;
+}
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -20,16 +37,34 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
-	asm volatile("int %1\n"
-		: "=a" (ret)
-		: "i" (T_SYSCALL),
-		  "a" (num),
-		  "d" (a1),
-		  "c" (a2),
-		  "b" (a3),
-		  "D" (a4),
-		  "S" (a5)
-		: "cc", "memory");
+	//
+	// Calls with at most four parameters use sysenter where the CPU
+	// has it; the kernel takes the return address in SI and our
+	// stack pointer in BP, and sysexit clobbers DX and CX.
+	if (a5 == 0 && sysenter_ok()) {
+		asm volatile("pushl %%ebp\n"
+			"movl %%esp, %%ebp\n"
+			"leal 1f, %%esi\n"
+			"sysenter\n"
+			"1: popl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "esi", "cc", "memory");
+	} else
+		asm volatile("int %1\n"
+			: "=a" (ret)
+			: "i" (T_SYSCALL),
+			  "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
 
 	if(check && ret > 0)
 		panic("cpu:%d, id:%x, syscall %d returned %d (> 0)", thisenv->env_cpunum, thisenv->env_id, num, ret);
@@ -73,6 +108,26 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+int
+sys_page_alloc_flags(envid_t envid, void *va, int perm, int flags)
+{
+	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, flags, 0);
+}
+
+int
+sys_page_alloc_contig(envid_t envid, void *va, int perm, unsigned order,
+		      physaddr_t *pa_store)
+{
+	return syscall(SYS_page_alloc_contig, 1, envid, (uint32_t) va, perm,
+		       order, (uint32_t) pa_store);
+}
+
+int
+sys_vm_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_vm_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
@@ -87,12 +142,36 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int prio, uint32_t weight)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, weight, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
+int
+sys_ncpu(void)
+{
+	return syscall(SYS_ncpu, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -117,12 +196,78 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_until(void *dstva, uint32_t deadline)
+{
+	return syscall(SYS_ipc_recv, 0, (uint32_t)dstva, deadline, 0, 0, 0);
+}
+
+int
+sys_sleep_until(uint32_t deadline)
+{
+	return syscall(SYS_sleep_until, 0, deadline, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_call_msg(envid_t envid, uint32_t value, const void *msg, size_t len, void *dstva)
+{
+	return syscall(SYS_ipc_call_msg, 0, envid, value, (uint32_t) msg, len, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv_msg(envid_t envid, uint32_t value, const void *msg, size_t len, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv_msg, 0, envid, value, (uint32_t) msg, len, (uint32_t) dstva);
+}
+
+int
+sys_batch(struct SyscallDesc *descs, size_t n)
+{
+	return syscall(SYS_batch, 0, (uint32_t) descs, n, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+uint64_t
+sys_time_usec(void)
+{
+	uint64_t usec;
+
+	syscall(SYS_time_usec, 1, (uint32_t) &usec, 0, 0, 0, 0);
+	return usec;
+}
+
+uint64_t
+sys_time_nsec(void)
+{
+	uint64_t nsec;
+
+	syscall(SYS_time_nsec, 1, (uint32_t) &nsec, 0, 0, 0, 0);
+	return nsec;
+}
+
 int
 sys_transmit_pkt(uint32_t length, char* pkt)
 {
@@ -33,7 +33,7 @@ thread_wakeup(volatile uint32_t *addr) {
 
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
-    uint32_t s = sys_time_msec();
+    uint32_t s = time_msec();
     uint32_t p = s;
 
     cur_tc->tc_wait_addr = addr;
@@ -47,8 +47,13 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
-	p = sys_time_msec();
+	// With no other thread to run, nothing here can change until
+	// the deadline, so let the kernel wake us then.
+	if (!thread_queue.tq_first)
+	    sys_sleep_until(msec);
+	else
+	    thread_yield();
+	p = time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
@@ -101,7 +101,7 @@ net_timer(uint32_t arg)
 	struct timer_thread *t = (struct timer_thread *) arg;
 
 	for (;;) {
-		uint32_t cur = sys_time_msec();
+		uint32_t cur = time_msec();
 
 		lwip_core_lock();
 		t->func();
@@ -169,9 +169,9 @@ process_timer(envid_t envid) {
 		return;
 	}
 
-	start = sys_time_msec();
+	start = time_msec();
 	thread_yield();
-	now = sys_time_msec();
+	now = time_msec();
 
 	to = TIMER_INTERVAL - (now - start);
 	ipc_send(envid, to, 0, 0);
@@ -181,8 +181,19 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	// A request that came in an IPC message is copied here
+	uint32_t msg[IPC_MSG_MAX / sizeof(uint32_t)];
 };
 
+// Requests small enough to arrive in an IPC message (see nsipc_msg)
+// instead of a page.  None of them writes reply data.
+static bool
+msg_request(int32_t reqno)
+{
+	return reqno == NSREQ_SHUTDOWN || reqno == NSREQ_CLOSE ||
+		reqno == NSREQ_LISTEN;
+}
+
 static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
@@ -249,8 +260,10 @@ serve_thread(uint32_t a) {
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, 0, 0);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	if ((void *) args->req != args->msg) {
+		put_buffer(args->req);
+		sys_page_unmap(0, (void*) args->req);
+	}
 	free(args);
 }
 
@@ -283,8 +296,10 @@ serve(void) {
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All remaining requests must contain an argument page,
+		// except small ones sent in a message
+		if (!(perm & PTE_P) &&
+		    !(msg_request(reqno) && thisenv->env_ipc_msglen)) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
 			continue; // just leave it hanging...
 		}
@@ -298,6 +313,13 @@ serve(void) {
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
+		if (!(perm & PTE_P)) {
+			put_buffer(va);
+			memset(args->msg, 0, sizeof(args->msg));
+			memmove(args->msg, (const void *) thisenv->env_ipc_msg,
+				thisenv->env_ipc_msglen);
+			args->req = (union Nsipc *) args->msg;
+		}
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -316,9 +338,18 @@ void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	int n, r;
 
 	binaryname = "ns";
 
+	// Give the network server and its helpers, which inherit the mask,
+	// the core below the file server's (the last one, see fs/serv.c)
+	// if that is not the boot CPU, or else share the file server's.
+	// If pinning fails, run wherever the scheduler puts us.
+	if ((n = sys_ncpu()) > 1
+	    && (r = sys_env_set_affinity(0, 1 << (n > 2 ? n - 2 : n - 1))) < 0)
+		cprintf("ns: cannot set CPU affinity: %e\n", r);
+
 	// fork off the timer thread which will send us periodic messages
 	timer_envid = fork();
 	if (timer_envid < 0)
@@ -1,25 +1,70 @@
-// Demonstrate lack of fairness in IPC.
-// Start three instances of this program as envs 1, 2, and 3.
-// (user/idle is env 0).
+// Benchmark weighted fair-share scheduling.  Fork spinning environments
+// with weights 1:2:4, let them compete for a while, and check that each
+// got CPU time in proportion to its weight.  The shares only mean
+// something if the spinners compete for a single CPU, so everything is
+// pinned to CPU 0.
 
 #include <inc/lib.h>
 
+#define NSPIN		3
+#define RUN_MSEC	1000
+#define TOLERANCE	5	// percentage points
+
+static const uint32_t weights[NSPIN] = {
+	ENV_WEIGHT_DEFAULT, 2 * ENV_WEIGHT_DEFAULT, 4 * ENV_WEIGHT_DEFAULT
+};
+
 void
 umain(int argc, char **argv)
 {
-	envid_t who, id;
-
-	id = sys_getenvid();
-
-	if (thisenv == &envs[1]) {
-		while (1) {
-			ipc_recv(&who, 0, 0);
-			cprintf("%x recv from %x\n", id, who);
-		}
-	} else {
-		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
-		while (1)
-			ipc_send(envs[1].env_id, 0, 0, 0);
+	envid_t kids[NSPIN];
+	uint64_t runtime[NSPIN], total;
+	uint32_t weight_sum, share, expect;
+	int i, r, ok;
+
+	// Run in the real-time class, above the spinners, so that we get
+	// to set them up, wake up on time and stop them.
+	if ((r = sys_env_set_priority(0, 1, 0)) < 0)
+		panic("sys_env_set_priority: %e", r);
+	// The spinners inherit this.
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+
+	weight_sum = 0;
+	for (i = 0; i < NSPIN; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0)
+			while (1)
+				/* spin */;
+		if ((r = sys_env_set_priority(kids[i], ENV_PRIO_NORMAL,
+					      weights[i])) < 0)
+			panic("sys_env_set_priority: %e", r);
+		weight_sum += weights[i];
 	}
-}
 
+	sys_sleep_until(time_msec() + RUN_MSEC);
+
+	total = 0;
+	for (i = 0; i < NSPIN; i++) {
+		sys_env_destroy(kids[i]);
+		runtime[i] = envs[ENVX(kids[i])].env_runtime;
+		total += runtime[i];
+	}
+	if (total == 0)
+		panic("spinners never ran");
+
+	ok = 1;
+	for (i = 0; i < NSPIN; i++) {
+		share = runtime[i] * 100 / total;
+		expect = weights[i] * 100 / weight_sum;
+		cprintf("fairness: weight %d got %d%% of the CPU (expected %d%%)\n",
+			weights[i], share, expect);
+		if (share + TOLERANCE < expect || share > expect + TOLERANCE)
+			ok = 0;
+	}
+	if (!ok)
+		panic("fairness: weights not honoured");
+	else
+		cprintf("fairness: OK\n");
+}
@@ -0,0 +1,75 @@
+// Fork an environment with a large malloc heap, with ufork and with
+// fork, and check that the child's writes stay out of the parent's
+// heap.  fork shares the page tables, so it should not get slower as
+// the heap grows.
+
+#include <inc/lib.h>
+
+#define NCHUNK		16
+#define CHUNKSZ		(512 * 1024)
+
+static uint32_t *chunk[NCHUNK];
+
+static void
+fill(uint32_t seed)
+{
+	int i, j;
+
+	for (i = 0; i < NCHUNK; i++)
+		for (j = 0; j < CHUNKSZ / 4; j += PGSIZE / 4)
+			chunk[i][j] = seed + i + j;
+}
+
+static int
+check(uint32_t seed)
+{
+	int i, j;
+
+	for (i = 0; i < NCHUNK; i++)
+		for (j = 0; j < CHUNKSZ / 4; j += PGSIZE / 4)
+			if (chunk[i][j] != seed + i + j)
+				return 0;
+	return 1;
+}
+
+static uint32_t
+bench(const char *name, envid_t (*forkfn)(void))
+{
+	envid_t child;
+	uint64_t start, t;
+
+	start = time_nsec();
+	if ((child = forkfn()) < 0)
+		panic("%s: %e", name, child);
+	t = time_nsec() - start;
+	if (child == 0) {
+		if (!check(0))
+			panic("%s: child sees the wrong heap", name);
+		fill(1000);
+		if (!check(1000))
+			panic("%s: child's writes were lost", name);
+		exit();
+	}
+	wait(child);
+	if (!check(0))
+		panic("%s: child's writes reached the parent", name);
+	return t / 1000;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t ufork_us, fork_us;
+	int i;
+
+	for (i = 0; i < NCHUNK; i++)
+		if (!(chunk[i] = malloc(CHUNKSZ)))
+			panic("malloc failed");
+	fill(0);
+
+	ufork_us = bench("ufork", ufork);
+	fork_us = bench("fork", fork);
+	cprintf("forkheap: %d KB heap, ufork %d us, fork %d us\n",
+		NCHUNK * CHUNKSZ / 1024, ufork_us, fork_us);
+	cprintf("forkheap: OK\n");
+}
@@ -0,0 +1,54 @@
+// Time a binary tree of forks, once with the user-level ufork and once
+// with the in-kernel fork.  Every environment writes to a few pages of
+// its data segment, so both runs pay for copy-on-write faults too.
+
+#include <inc/lib.h>
+
+#define DEPTH	5
+#define NTOUCH	4
+
+static char buf[NTOUCH * PGSIZE];
+
+static void
+forktree(envid_t (*forkfn)(void), int depth)
+{
+	envid_t child[2];
+	int i;
+
+	for (i = 0; i < NTOUCH; i++)
+		buf[i * PGSIZE] = depth;
+	if (depth == DEPTH)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		if ((child[i] = forkfn()) < 0)
+			panic("fork: %e", child[i]);
+		if (child[i] == 0) {
+			forktree(forkfn, depth + 1);
+			exit();
+		}
+	}
+	for (i = 0; i < 2; i++)
+		wait(child[i]);
+}
+
+static uint64_t
+bench(envid_t (*forkfn)(void))
+{
+	uint64_t start;
+
+	start = time_nsec();
+	forktree(forkfn, 0);
+	return time_nsec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t ufork_us, fork_us;
+
+	ufork_us = bench(ufork) / 1000;
+	fork_us = bench(fork) / 1000;
+	cprintf("forktreebench: %d environments, ufork %d us, fork %d us\n",
+		(2 << DEPTH) - 1, ufork_us, fork_us);
+}
@@ -0,0 +1,47 @@
+// Several senders on several CPUs send to one receiver with the
+// blocking sys_ipc_send.  Every message must arrive, each sender's in
+// order, and nobody may be left blocked.
+
+#include <inc/lib.h>
+
+#define NSENDER		6
+#define NMSG		200
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), who, senders[NSENDER];
+	uint32_t next[NSENDER], v;
+	int ncpu = sys_ncpu(), i, j, r;
+
+	for (i = 0; i < NSENDER; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			if ((r = sys_env_set_affinity(0, 1 << (i % ncpu))) < 0)
+				panic("sys_env_set_affinity: %e", r);
+			for (j = 0; j < NMSG; j++)
+				ipc_send(parent, (i << 16) | j, 0, 0);
+			exit();
+		}
+		senders[i] = who;
+		next[i] = 0;
+	}
+
+	for (j = 0; j < NSENDER * NMSG; j++) {
+		// Let the senders pile up on our queue now and then
+		if (j % 16 == 0)
+			sys_yield();
+		v = ipc_recv(&who, 0, 0);
+		i = v >> 16;
+		if (i >= NSENDER || who != senders[i])
+			panic("ipcsendq: %08x from %08x", v, who);
+		if ((v & 0xffff) != next[i])
+			panic("ipcsendq: sender %d sent %d, want %d",
+			      i, v & 0xffff, next[i]);
+		next[i]++;
+	}
+	cprintf("ipcsendq: %d messages from %d senders on %d CPUs\n",
+		NSENDER * NMSG, NSENDER, MIN(NSENDER, ncpu));
+	cprintf("ipcsendq: OK\n");
+}
@@ -0,0 +1,45 @@
+// Start several environments whose heaps hold identical data, then
+// leave them all blocked so that the kernel monitor comes up.  After
+// "merge" has been typed there twice (the first pass only picks the
+// stable pages), the NCHILD copies of the NPAGE pages should share
+// NPAGE stable pages, and each child's page of zeroes the zero page.
+
+#include <inc/lib.h>
+
+#define NCHILD		8
+#define NPAGE		16
+
+static void
+child(void)
+{
+	uint32_t *buf;
+	int j;
+
+	if (!(buf = malloc((NPAGE + 1) * PGSIZE)))
+		panic("malloc failed");
+	for (j = 0; j < NPAGE * PGSIZE / 4; j++)
+		buf[j] = j * 2654435761u;
+	// A page that was written and then cleared again
+	buf[NPAGE * PGSIZE / 4] = 1;
+	memset(buf + NPAGE * PGSIZE / 4, 0, PGSIZE);
+	ipc_recv(0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			child();
+			return;
+		}
+	}
+	cprintf("samepages: %d environments with %d identical pages; "
+		"run \"merge\" in the monitor\n", NCHILD, NPAGE);
+	ipc_recv(0, 0, 0);
+}
@@ -0,0 +1,68 @@
+// Sum a large array with one thread, then with NTHREAD threads made by
+// sfork, and check that the threads see each other's memory.
+
+#include <inc/lib.h>
+
+#define NTHREAD		4
+#define NWORD		(256 * 1024)
+#define NPASS		8
+
+static uint32_t data[NWORD];
+static uint32_t partial[NTHREAD];
+static volatile int done;
+
+static uint32_t
+sum(int part, int nparts)
+{
+	uint32_t s = 0;
+	int i, j;
+
+	for (j = 0; j < NPASS; j++)
+		for (i = part * (NWORD / nparts); i < (part + 1) * (NWORD / nparts); i++)
+			s += data[i];
+	return s;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	uint32_t one_us, many_us, total, expect;
+	envid_t who;
+	int i;
+
+	for (i = 0; i < NWORD; i++)
+		data[i] = i;
+
+	start = time_nsec();
+	expect = sum(0, 1);
+	one_us = (time_nsec() - start) / 1000;
+
+	start = time_nsec();
+	for (i = 1; i < NTHREAD; i++) {
+		if ((who = sfork()) < 0)
+			panic("sfork: %e", who);
+		if (who == 0) {
+			if (thisenv->env_id != sys_getenvid())
+				panic("thread %d: thisenv is wrong", i);
+			partial[i] = sum(i, NTHREAD);
+			__sync_fetch_and_add(&done, 1);
+			exit();
+		}
+	}
+	partial[0] = sum(0, NTHREAD);
+	while (done < NTHREAD - 1)
+		sys_yield();
+	many_us = (time_nsec() - start) / 1000;
+
+	total = 0;
+	for (i = 0; i < NTHREAD; i++)
+		total += partial[i];
+	if (total != expect)
+		panic("sforksum: got %u, want %u", total, expect);
+	if (thisenv->env_id != sys_getenvid())
+		panic("sforksum: thisenv is wrong");
+	cprintf("sforksum: 1 thread %d us, %d threads %d us\n",
+		one_us, NTHREAD, many_us);
+	cprintf("sforksum: OK\n");
+}
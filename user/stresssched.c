@@ -1,22 +1,49 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILD	20
+#define BURN	2000000
+
+// Shared with all the children, to measure how soon each weight class
+// finishes a fixed amount of work after the parent starts forking.
+#define STATS	((struct stats *) 0xA0000000)
+struct stats {
+	uint64_t start;
+	volatile uint32_t done;
+	volatile uint32_t finish_usec[2];
+};
 
 volatile int counter;
 
 void
 umain(int argc, char **argv)
 {
-	int i, j;
+	int i, j, heavy, r;
 	int seen;
 	envid_t parent = sys_getenvid();
+	envid_t child;
+	uint32_t avg_light, avg_heavy;
+
+	if ((r = sys_page_alloc(0, STATS, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	STATS->start = time_usec();
 
-	// Fork several environments
-	for (i = 0; i < 20; i++)
-		if (fork() == 0)
+	// Fork several environments.  Every other one gets four times the
+	// default weight.
+	for (i = 0; i < NCHILD; i++) {
+		if ((child = fork()) == 0)
 			break;
-	if (i == 20) {
+		if (child < 0)
+			panic("fork: %e", child);
+		if (i % 2 && (r = sys_env_set_priority(child, ENV_PRIO_NORMAL,
+						       4 * ENV_WEIGHT_DEFAULT)) < 0)
+			panic("sys_env_set_priority: %e", r);
+	}
+	if (i == NCHILD) {
 		sys_yield();
 		return;
 	}
+	heavy = i % 2;
 
 	// Wait for the parent to finish forking
 	while (envs[ENVX(parent)].env_status != ENV_FREE)
@@ -35,5 +62,18 @@ umain(int argc, char **argv)
 	// Check that we see environments running on different CPUs
 	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
 
+	// Compete for the CPU: the heavier environments should finish first.
+	for (j = 0; j < BURN; j++)
+		counter++;
+	atomic_add(&STATS->finish_usec[heavy], time_usec() - STATS->start);
+	if (atomic_add(&STATS->done, 1) == NCHILD - 1) {
+		avg_light = STATS->finish_usec[0] / (NCHILD / 2);
+		avg_heavy = STATS->finish_usec[1] / (NCHILD / 2);
+		cprintf("stresssched: weight %d finished after %d us on average, "
+			"weight %d after %d us\n",
+			ENV_WEIGHT_DEFAULT, avg_light,
+			4 * ENV_WEIGHT_DEFAULT, avg_heavy);
+		cprintf("stresssched: weights %s\n",
+			avg_heavy <= avg_light ? "honoured" : "NOT honoured");
+	}
 }
-
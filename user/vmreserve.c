@@ -0,0 +1,74 @@
+// Reserve a large demand-zero region, touch a few pages of it, and
+// check that untouched pages cost nothing, that reservations survive
+// fork and sys_page_map, and that unmapping drops them.
+
+#include <inc/lib.h>
+
+#define REGION		((unsigned char *) 0x20000000)
+#define NPAGE		1024
+#define STRIDE		64
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	uint32_t reserve_us, alloc_us;
+	envid_t child;
+	int i, r;
+
+	start = time_nsec();
+	if ((r = sys_vm_reserve(0, REGION, NPAGE * PGSIZE,
+				PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_vm_reserve: %e", r);
+	reserve_us = (time_nsec() - start) / 1000;
+
+	for (i = 0; i < NPAGE; i++)
+		if ((uvpt[PGNUM(REGION + i * PGSIZE)] & (PTE_P|PTE_ZERO))
+		    != PTE_ZERO)
+			panic("page %d is not reserved", i);
+	for (i = 0; i < NPAGE; i += STRIDE) {
+		if (REGION[i * PGSIZE + 17] != 0)
+			panic("page %d is not zero", i);
+		REGION[i * PGSIZE] = i;
+	}
+	for (i = 0; i < NPAGE; i++)
+		if (!(uvpt[PGNUM(REGION + i * PGSIZE)] & PTE_P) != !!(i % STRIDE))
+			panic("page %d: wrong pages were filled in", i);
+
+	// The kernel fills in pages it touches for us
+	if ((r = sys_page_map(0, REGION + PGSIZE, 0, UTEMP,
+			      PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+	*(int *) UTEMP = 42;
+	if (*(int *) (REGION + PGSIZE) != 42)
+		panic("sys_page_map did not share the page");
+	sys_page_unmap(0, UTEMP);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NPAGE; i += STRIDE / 2)
+			if (REGION[i * PGSIZE] != (i % STRIDE ? 0 : i % 256))
+				panic("child sees page %d wrong", i);
+		REGION[(STRIDE / 2) * PGSIZE] = 1;
+		exit();
+	}
+	wait(child);
+	if (REGION[(STRIDE / 2) * PGSIZE] != 0)
+		panic("child's write reached the parent");
+
+	if ((r = sys_page_unmap(0, REGION + 2 * PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpt[PGNUM(REGION + 2 * PGSIZE)] != 0)
+		panic("sys_page_unmap left the reservation");
+
+	start = time_nsec();
+	for (i = 0; i < NPAGE; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	alloc_us = (time_nsec() - start) / 1000;
+	cprintf("vmreserve: %d pages, reserve %d us, alloc %d us\n",
+		NPAGE, reserve_us, alloc_us);
+	cprintf("vmreserve: OK\n");
+}
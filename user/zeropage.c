@@ -0,0 +1,44 @@
+// Read a demand-zero region before writing it: every page should map
+// the kernel's shared zero page copy-on-write, and the first write to
+// a page should give it a private copy without disturbing the others.
+
+#include <inc/lib.h>
+
+#define REGION		((volatile uint32_t *) 0x20000000)
+#define NPAGE		256
+#define WORDS		(PGSIZE / 4)
+
+void
+umain(int argc, char **argv)
+{
+	physaddr_t zero;
+	pte_t pte;
+	int i, r;
+
+	if ((r = sys_vm_reserve(0, (void *) REGION, NPAGE * PGSIZE,
+				PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_vm_reserve: %e", r);
+
+	for (i = 0; i < NPAGE; i++)
+		if (REGION[i * WORDS + i % WORDS] != 0)
+			panic("page %d is not zero", i);
+	zero = PTE_ADDR(uvpt[PGNUM(REGION)]);
+	for (i = 0; i < NPAGE; i++) {
+		pte = uvpt[PGNUM(REGION + i * WORDS)];
+		if ((pte & (PTE_P|PTE_W|PTE_COW)) != (PTE_P|PTE_COW))
+			panic("page %d is not copy-on-write: %08x", i, pte);
+		if (PTE_ADDR(pte) != zero)
+			panic("page %d is not the zero page", i);
+	}
+
+	REGION[3 * WORDS] = 3;
+	pte = uvpt[PGNUM(REGION + 3 * WORDS)];
+	if (!(pte & PTE_W) || PTE_ADDR(pte) == zero)
+		panic("write did not give the page its own copy");
+	for (i = 0; i < NPAGE; i++)
+		if (REGION[i * WORDS] != (i == 3 ? 3 : 0))
+			panic("page %d changed", i);
+
+	cprintf("zeropage: %d pages read with one physical page\n", NPAGE);
+	cprintf("zeropage: OK\n");
+}